@@ -0,0 +1,140 @@
+/*
+ * CRC-32C (Castagnoli polynomial 0x1EDC6F41, bit-reflected).
+ *
+ * On x86 with SSE4.2 and on ARMv8 with the CRC extension the work is
+ * done by the crc32 instructions, eight bytes at a time; otherwise a
+ * table is used.  Which is chosen is decided on the first call.
+ *
+ * Like zlib's crc32(), crc32c(0, buf, len) gives the CRC of buf, and
+ * crc32c(crc, more, n) continues a CRC with more data.
+ */
+
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define	HAVE_HWCRC	1
+#define	HWCRC_TARGET	__attribute__((target("sse4.2")))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define	HAVE_HWCRC	1
+#define	HWCRC_TARGET	__attribute__((target("+crc")))
+#endif
+
+#define	POLY		0x82f63b78	/* reflected 0x1EDC6F41 */
+
+static	uint32_t table[256];
+static	uint32_t (*impl)(uint32_t, const unsigned char *, size_t) = NULL;
+static	const char *implname;
+
+/*
+ * The portable way, a byte at a time.
+ */
+static uint32_t
+crcsoft(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len-- > 0) {
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return(crc);
+}
+
+#ifdef HAVE_HWCRC
+/*
+ * The processor's way, eight bytes at a time once p is aligned.
+ */
+HWCRC_TARGET static uint32_t
+crchard(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t word;
+
+	while (len > 0 && ((uintptr_t) p & 7) != 0) {
+#if defined(__aarch64__)
+		crc = __crc32cb(crc, *p++);
+#else
+		crc = _mm_crc32_u8(crc, *p++);
+#endif
+		len--;
+	}
+
+	for (; len >= 8; p += 8, len -= 8) {
+		(void) memcpy(&word, p, 8);
+#if defined(__aarch64__)
+		crc = __crc32cd(crc, word);
+#elif defined(__x86_64__)
+		crc = (uint32_t) _mm_crc32_u64(crc, word);
+#else
+		crc = _mm_crc32_u32(crc, (uint32_t) word);
+		crc = _mm_crc32_u32(crc, (uint32_t) (word >> 32));
+#endif
+	}
+
+	while (len-- > 0) {
+#if defined(__aarch64__)
+		crc = __crc32cb(crc, *p++);
+#else
+		crc = _mm_crc32_u8(crc, *p++);
+#endif
+	}
+	return(crc);
+}
+#endif
+
+/*
+ * Choose how to do it.
+ */
+static void
+setup(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+		}
+		table[i] = crc;
+	}
+
+	impl = crcsoft;
+	implname = "table";
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		impl = crchard;
+		implname = "sse4.2";
+	}
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		impl = crchard;
+		implname = "armv8 crc";
+	}
+#endif
+}
+
+/*
+ * Continue the CRC "crc" over len bytes at buf.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (impl == NULL) {
+		setup();
+	}
+	return(~(*impl)(~crc, buf, len));
+}
+
+/*
+ * Say how the CRCs are being computed.
+ */
+const char *
+crc32cimpl(void)
+{
+	if (impl == NULL) {
+		setup();
+	}
+	return(implname);
+}
@@ -0,0 +1,10 @@
+/*
+ * CRC-32C (Castagnoli), using the processor's CRC instructions where
+ * it has them, for cheap first-level fingerprints of file contents.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern	uint32_t crc32c(uint32_t, const void *, size_t);
+extern	const char *crc32cimpl(void);
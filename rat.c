@@ -15,6 +15,22 @@
 	We scan the list of files given on the command line, and insert each
 	file into our list; either in an already-existing equivalence class
 	or in a new class if the file is unlike any we have already seen.
+	Files are classed by the mount they were found through as well as
+	their device, since the kernel won't link across mount points
+	even within one filesystem. Each directory's device and inode are
+	remembered, and a directory seen before (through a bind mount, an
+	overlay of the same filesystem, or a symbolic link loop with -s)
+	is not entered again.
+
+	The classes are found by hashing their keys into a table split
+	into independent shards, each with its own lock; files are queued
+	in a buffer belonging to the scanning thread and added to the shards
+	a bufferful at a time, so scanners only meet at the shard locks and
+	then only once per shard per bufferful. The associativity list is
+	made by joining the shards' lists when the scan is over.
+	With -j, several threads walk the tree at once, taking directories
+	to read from a shared stack and pushing the subdirectories they
+	find on to it.
 	When this has been done, we try and amalgamate the files in each class
 	together. This is done by unlinking and forming new links, e.g:
 
@@ -33,9 +49,57 @@
 	file, or when they have been compared with every other file. This
 	process repeats until the list contains less than two items.
 
-	If either of the files to link together already has multiple links,
-	we delete the one with the lower link count and keep the one with
-	more links.
+	Files found to be identical to the first file of a sublist are
+	gathered into a group; the member with the most links is kept and
+	every other member of the group is replaced by a link to it.
+
+	Before any file in a class is read, we check that it could be
+	replaced at all: its filesystem must be writable, it must not be
+	immutable or append-only (which also stops it being linked to),
+	and its directory must let us rename and unlink it. Files that
+	fail the last test can still be kept, so they are only ever
+	compared with files that could be replaced by links to them.
+
+	With -I, the digest of every file seen is kept in an index file
+	from one run to the next, sorted by digest, and each file is looked
+	up in it so that it can be linked to an identical file found on
+	an earlier run even if that isn't in this run's list. Most files
+	looked up won't be there, so the index carries a Bloom filter of
+	its digests and another of its file sizes; these are read into
+	memory, and the rest of the index (which is mapped, not read) is
+	only touched when both say the file might be there.
+
+	The index is also a snapshot of what the last run learnt, so that
+	a run needn't start from nothing.  Beside the entries is a table
+	of them in order of device and inode number; a file whose inode is
+	there with the same size and modification time, and whose change
+	time is earlier than when it was last seen, takes its digest
+	from the index instead of being read again.
+
+	Files protected by fs-verity carry a digest of their contents that
+	the kernel keeps and checks, and will hand over without reading
+	them.  Two such files with the same digest are identical, and if
+	the digests were made the same way (the same algorithm, block size
+	and salt) and differ, so do the files; either way they are never
+	read.
+
+	On btrfs, every inode records the generation (transaction) that
+	last changed it.  With -G, the index also records, for each
+	directory named on the command line, its subvolume and the
+	subvolume's generation when the run began; on the next run, instead
+	of walking the directory, we search the subvolume's tree for the
+	inodes changed since that generation, as "btrfs subvolume find-new"
+	does, and find their names from their inode numbers.  Only those
+	files are entered in the class table, to be matched against the
+	index.  This needs CAP_SYS_ADMIN; without it, the directory is
+	walked as usual.
+
+	Replacements are not performed as they are found. Instead they are
+	queued, and once every class has been examined the queue is sorted
+	by the directory of the file to be replaced and run one directory
+	at a time through a single open directory descriptor, so that each
+	directory's metadata is updated in one burst rather than being
+	revisited throughout the run.
 
 	For safety reasons, we create a temporary link to each file before
 	we unlink it; then if the link fails, the original is replaced.
@@ -53,6 +117,38 @@
 	-p	ignore permissions of files.
 	-z	Don't link zero-length files together.
 	-f file	specify file containing filenames to rationalize; '-' means stdin
+	-D how	durability of the links made: "none", "dir" to fsync each
+		directory after its links are made, or "fs" to syncfs each
+		filesystem once at the end.
+	-S	print statistics at the end of the run.
+	-x	keep a digest of each file's contents in an extended
+		attribute, and use it to tell files apart without reading
+		them on later runs.
+	-T	trust the digests: link files whose SHA-256 digests match
+		without comparing their contents.
+	-C how	fingerprint possible duplicates with CRC-32C first, over
+		the "prefix", a "sample" of blocks or the "full" file, and
+		only hash or compare those whose fingerprints match.
+	-H	back the read buffers with transparent huge pages.
+	-o	include offline files (HSM stubs, whose data is elsewhere);
+		normally they are left alone so as not to recall them.
+	-t secs	give up on any file whose open or read takes longer than
+		secs seconds, and leave it alone for the rest of the run.
+	-K how	choose the file to keep among identical ones by "links"
+		(the most; the default) or "extents" (the fewest, so the
+		least fragmented, then the most links).
+	-I file	keep an index of the contents of every file seen in "file",
+		and link new files to those listed in it.
+	-G	with -I, on btrfs, don't walk directories the index has seen
+		before; look only at the files changed since then.
+	-j n	walk the directory tree with n threads at once.
+	-w n	report where the reading was done to little purpose: the
+		bytes read and freed under each directory n levels down,
+		worst first.
+	-e n	don't link anything; estimate the space that would be freed
+		by hashing n classes of each power-of-two file size.
+	-a	don't link anything; report the space that would be freed
+		with each combination of -u, -g, -p and -z.
 * libraries used:
 	standard
 * environments:
@@ -65,8 +161,11 @@
 
 ***/
 
+#define	_GNU_SOURCE			/* for syncfs() */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>			/* for off_t etc. */
 #include <unistd.h>			/* for uid_t etc. */
@@ -76,16 +175,66 @@
 #include <errno.h>			/* for error messages */
 #include <stdarg.h>
 #include <time.h>			/* for time() */
+#include <stdint.h>
+#include <stddef.h>			/* for offsetof() */
+#include <stdatomic.h>			/* for the class table locks */
+#include <math.h>			/* for sqrt() */
+#include <sys/xattr.h>			/* for the digest cache */
+#include <sys/mman.h>			/* for madvise() */
+#include <signal.h>			/* for keeping them from our threads */
+#include <pthread.h>			/* for the log writer and -j */
+#include "sha256.h"
+#include "crc32c.h"
 
 /*
  * This code ported to POSIX from ancient BSD-style cmd Pfizer Sandwich 1/5/98.
  */
 #include <dirent.h>
+#include <sys/statvfs.h>		/* for read-only filesystems */
+#include <sys/sysmacros.h>		/* for makedev() */
+#include <sys/ioctl.h>
+#include <linux/fs.h>			/* for FS_IOC_GETFLAGS */
+#include <linux/fiemap.h>		/* for counting extents */
+#include <linux/fsverity.h>		/* for fs-verity digests */
+#include <linux/btrfs.h>		/* for -G */
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>		/* for BTRFS_SUPER_MAGIC */
+#include <sys/vfs.h>			/* for fstatfs() */
+#include <endian.h>			/* btrfs items are little-endian */
+
+/*
+ * Static probes, for tracing with bpftrace, perf or systemtap, if
+ * built with -DHAVE_SDT.  Each is a single no-op instruction until
+ * it is traced.  The provider is "rat"; the probes are
+ *	dir__enter(name), dir__exit(name, entries or -1)
+ *	file__stat(name, size, inode)
+ *	class__new(size, dev, hash)
+ *	compare__start(name1, name2)
+ *	compare__end(name1, name2, bytes read from both, offset of
+ *		first difference or -1, result), also when one can't
+ *		be opened
+ *	replace__start(from, to), and replace__rename(to, result),
+ *	replace__link(to, result) and replace__unlink(to, result)
+ *	as each step of a replacement is done.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define	PROBE1(name, a)			DTRACE_PROBE1(rat, name, a)
+#define	PROBE2(name, a, b)		DTRACE_PROBE2(rat, name, a, b)
+#define	PROBE3(name, a, b, c)		DTRACE_PROBE3(rat, name, a, b, c)
+#define	PROBE5(name, a, b, c, d, e)	DTRACE_PROBE5(rat, name, a, b, c, d, e)
+#else
+#define	PROBE1(name, a)			((void) (a))
+#define	PROBE2(name, a, b)		((void) (a), (void) (b))
+#define	PROBE3(name, a, b, c)		((void) (a), (void) (b), (void) (c))
+#define	PROBE5(name, a, b, c, d, e)	((void) (a), (void) (b), (void) (c), \
+					 (void) (d), (void) (e))
+#endif
 
 /*
  * Symbolic link handling is only available if there are any to handle.
  */
-#define	USAGE	"usage: rat [-vnrsugpz] [ file ... | -f listfile ]\n"
+#define	USAGE	"usage: rat [-vnrsugpzSxTHoa] [-D none|dir|fs] [-C prefix|sample|full] [-t timeout] [-K links|extents] [-I index [-G]] [-j threads] [-w depth] [-e samples] [ file ... | -f listfile ]\n"
 
 
 #define ISDIR		1		/* miscellaneous return values */
@@ -94,6 +243,141 @@
 
 #define	min(a, b)	((a) < (b) ? (a) : (b))
 
+#define	NSTRATA		64		/* powers of two of file size, for -e */
+#define	Z95		1.96		/* normal deviate for 95% confidence */
+#define	CLASSSAMPLE	64		/* most files hashed in a class, for -e */
+
+#define	CRC_NONE	0		/* -C: no fingerprints */
+#define	CRC_PREFIX	1		/* of the first PREFIXLEN bytes */
+#define	CRC_SAMPLE	2		/* of NSAMPLES blocks spread through it */
+#define	CRC_FULL	3		/* of the whole file */
+
+#define	PREFIXLEN	65536
+#define	NSAMPLES	16
+#define	SAMPLELEN	4096
+
+/*
+ * All file data is read into buffers from a pool belonging to each
+ * thread.  They are aligned well enough for O_DIRECT, and with -H
+ * are aligned to a huge page, and so can be backed by a few huge
+ * pages and as many TLB entries.  A thread needs at most NIOBUFS at once.
+ */
+#define	IOBUFSIZE	(8 * 1024 * 1024)	/* bytes in each buffer */
+#define	IOBUFALIGN	4096			/* normal alignment */
+#define	HUGEALIGN	(2 * 1024 * 1024)	/* alignment for -H */
+#define	NIOBUFS		2			/* compare() needs two */
+
+/*
+ * Hashing and fingerprinting read a whole file, or a stretch of it, in
+ * reads of HASHREAD, which is all that readahead needs; only compare()
+ * has a use for reads as big as the buffers.
+ */
+#define	HASHREAD	(2 * 1024 * 1024)
+
+/*
+ * compare() reads RAMPMIN bytes of each file first, since most files
+ * that differ do so near the start, and doubles the size of each read
+ * after that, up to a cap for the device, which starts at IOBUFSIZE.
+ * The throughput of each size of read from RAMPTUNE up is measured on
+ * each device, and once each has been measured RAMPSAMPLES times, the
+ * cap is the smallest size that comes within RAMPGAIN of the best.
+ * One compare in RAMPPROBE on a device goes all the way to IOBUFSIZE,
+ * so that sizes above the cap go on being measured.
+ */
+#define	RAMPMIN		4096
+#define	NRAMP		12		/* RAMPMIN up to IOBUFSIZE */
+#define	RAMPTUNE	6		/* 256KiB: smallest cap */
+#define	RAMPSAMPLES	4
+#define	RAMPGAIN	0.95
+#define	RAMPPROBE	32
+#define	RAMPWEIGHT	0.2		/* of each measurement in the average */
+
+#if (RAMPMIN << (NRAMP - 1)) != IOBUFSIZE
+#error "compare() must ramp from RAMPMIN up to IOBUFSIZE"
+#endif
+
+typedef struct devtune {
+	dev_t		t_dev;		/* the device */
+	int		t_cap;		/* largest read, log2 of RAMPMIN's */
+	unsigned long	t_compares;	/* compares on it */
+	double		t_rate[NRAMP];	/* bytes a second at each size */
+	unsigned long	t_samples[NRAMP]; /* reads it is taken from */
+} Devtune;
+
+typedef struct bufpool {
+	char		*p_bufs[NIOBUFS];	/* allocated on first use */
+	int		p_used;			/* how many are in use */
+} Bufpool;
+
+/*
+ * With -t, opens and reads are done by a helper thread, so that the
+ * thread wanting them can stop waiting when time runs out even if the
+ * call can't be interrupted (as on a hard NFS mount, or during a
+ * recall from tape).  A helper that is given up on is left to finish
+ * the call, then cleans up after it (closing the file it opened, or
+ * freeing the buffer it read into) and exits; the next call gets a
+ * new helper.
+ */
+#define	IO_OPEN		1
+#define	IO_READ		2
+
+typedef struct iohelper {
+	pthread_mutex_t	x_lock;
+	pthread_cond_t	x_cond;		/* a call posted, or finished */
+	int		x_op;		/* IO_OPEN or IO_READ; 0 if idle */
+	char		*x_name;	/* file to open */
+	int		x_fd;		/* or to read from */
+	char		*x_buf;		/* into this */
+	size_t		x_len;
+	off_t		x_off;		/* -1 to carry on from the last */
+	ssize_t		x_result;	/* what the call returned */
+	int		x_errno;	/* and errno */
+	int		x_done;		/* it has returned */
+	int		x_abandoned;	/* nobody is waiting for it */
+} Iohelper;
+
+/*
+ * The names of the files in quarantine are kept in a hash table.
+ */
+#define	QBUCKETS	1024
+
+typedef struct qentry {
+	struct qentry	*q_next;	/* next in the bucket */
+	char		*q_name;
+} Qentry;
+
+/*
+ * A file is taken to be an offline stub if it is at least STUBMIN bytes
+ * long (smaller ones may be stored inline with no blocks of their own)
+ * and has fewer than one block allocated in STUBRATIO of its length,
+ * yet claims to be data, not holes, throughout at least that much.
+ * We look at no more than STUBEXTENTS data extents to decide.
+ * Compressed files look just the same, so the test isn't made of files
+ * that statx says are compressed, nor on filesystems that may compress
+ * files without saying so, or whose block counts come from elsewhere.
+ */
+#define	STUBMIN		65536
+#define	STUBRATIO	8
+#define	STUBEXTENTS	64
+
+#ifndef ZFS_SUPER_MAGIC
+#define	ZFS_SUPER_MAGIC		0x2fc12fc1
+#endif
+#ifndef BCACHEFS_SUPER_MAGIC
+#define	BCACHEFS_SUPER_MAGIC	0xca451a4e
+#endif
+
+/*
+ * How to choose the file to keep (-K).
+ */
+#define	KEEP_LINKS	0		/* the one with the most links */
+#define	KEEP_EXTENTS	1		/* the least fragmented */
+
+#define	W_UID		1		/* -a: what if -u were given */
+#define	W_GID		2		/* what if -g were given */
+#define	W_PERMS		4		/* what if -p were given */
+#define	W_ALL		8		/* number of combinations */
+
 
 /*
  * Each file is described by the following structure, which is
@@ -101,49 +385,554 @@
  */
 typedef struct info {
 	struct info	*i_next;	/* pointer to next object */
+	struct info	*i_same;	/* next file found identical to this */
 	char		*i_name;	/* pointer to file name */
 	char		*i_dir;		/* pointer to directory */
 	ino_t		i_ino;		/* inode number */
+	uid_t		i_uid;		/* owner of the name, for sticky dirs */
+	nlink_t		i_nlink;	/* link count when last looked at */
+	struct timespec	i_mtime;	/* modification time */
+	struct timespec	i_ctime;	/* inode change time */
+	char		i_hashed;	/* how far i_digest is known (DIG_*) */
+	char		i_trusted;	/* joined its group on digest alone */
+	char		i_fixed;	/* can't be replaced, only kept */
+	char		i_indexed;	/* found through the index */
+	char		i_linked;	/* to be linked, or linked to */
+	char		i_crcok;	/* is i_crc valid? */
+	char		i_isverity;	/* statx says fs-verity is on */
+	uint32_t	i_crc;		/* CRC-32C fingerprint of contents */
+	unsigned char	i_digest[SHA256_LEN];	/* digest of contents */
+	struct verity	*i_verity;	/* its fs-verity digest, if any */
 } Info;
 
+/*
+ * The fs-verity digest of a file, and how it was made.  The digest
+ * covers the algorithm, block size and salt, so files with the same
+ * digest are identical whatever they are; files with different digests
+ * are only known to differ if all three are the same.
+ */
+#define	VERITY_MAXDIGEST	64
+#define	VERITY_MAXSALT		32
+
+typedef struct verity {
+	uint16_t	y_alg;		/* FS_VERITY_HASH_ALG_* */
+	uint16_t	y_len;		/* bytes of digest */
+	unsigned char	y_digest[VERITY_MAXDIGEST];
+	int		y_params;	/* are the next three known? */
+	uint8_t		y_logbs;	/* log2 of its block size */
+	uint8_t		y_saltlen;
+	unsigned char	y_salt[VERITY_MAXSALT];
+} Verity;
+
+/*
+ * How two files were found identical, for the messages.
+ */
+#define	BY_COMPARE	0		/* their contents were compared */
+#define	BY_DIGEST	1		/* their SHA-256 digests, with -T */
+#define	BY_VERITY	2		/* their fs-verity digests */
+
 /*
  * Head describes a list of associated files, pointed to by h_info,
  * together with common information.
  */
 typedef struct header {
 	struct header	*h_next;	/* pointer to next object */
+	struct header	*h_chain;	/* next in the same hash bucket */
+	uint64_t	h_hash;		/* hash of the class key */
 	Info		*h_info;	/* pointer to list of files */
 	off_t		h_size;		/* size of files */
 	dev_t		h_dev;		/* device number */
+	uint64_t	h_mnt;		/* mount it was found through */
 	uid_t		h_uid;		/* ownership */
 	gid_t		h_gid;		/* group ownership */
 	uid_t		h_perms;	/* permissions */
 } Head;
 
+/*
+ * A pending replacement of o_dir/o_base (whose full name is o_to)
+ * by a link to o_from.  These are queued by plan() and performed
+ * in directory order by linkall().
+ */
+typedef struct op {
+	char		*o_from;	/* file to keep */
+	char		*o_to;		/* file to be replaced */
+	char		*o_dir;		/* directory part of o_to */
+	char		*o_base;	/* last component of o_to */
+	off_t		o_size;		/* space freed by doing it */
+	off_t		o_length;	/* size of both files */
+	Info		*o_keep;	/* o_from, as plan() found it */
+	Info		*o_file;	/* and o_to */
+	char		o_trusted;	/* decided on digests alone: BY_* */
+} Op;
+
+/*
+ * The class table is split into NSHARDS shards, chosen by the top bits
+ * of the key's hash, each a chained hash table with its own lock.
+ */
+#define	NSHARDS		64
+#define	SHARDBITS	6		/* log2(NSHARDS) */
+#define	NBUCKETS	256		/* initial buckets per shard */
+
+typedef struct shard {
+	atomic_flag	t_lock;		/* held while adding to the shard */
+	Head		**t_buckets;	/* hash chains */
+	size_t		t_nbuckets;	/* how many; a power of two */
+	size_t		t_count;	/* classes in the shard */
+	Head		*t_list;	/* those classes, through h_next */
+	Head		*t_tail;	/* the last of them */
+} Shard;
+
+/*
+ * Files waiting to be put in their classes, one buffer per scanning
+ * thread.  Each is described by a Head as filled in by newinfo().
+ */
+#define	SCANBUF		256
+
+typedef struct scanbuf {
+	int		b_count;	/* entries in use */
+	Head		b_heads[SCANBUF];
+} Scanbuf;
+
+/*
+ * A directory waiting to be read by one of the -j threads.
+ */
+typedef struct dirwork {
+	struct dirwork	*d_next;	/* the one pushed before it */
+	char		*d_name;	/* its name */
+} Dirwork;
+
+/*
+ * For -a, a file together with the class it was found in.
+ */
+typedef struct member {
+	Info		*m_info;	/* the file */
+	Head		*m_head;	/* its size, owner etc. */
+} Member;
+
+/*
+ * The index file (-I) starts with this header.  The rest of it is laid
+ * out as the header says: a Bloom filter of digests, one of sizes,
+ * the entries sorted by digest, the attributes they share, the entry
+ * numbers sorted by device and inode, and the path names they refer to.
+ * An entry holds only what differs from file to file; the device,
+ * owner and permissions, which few files differ in, are kept once in
+ * the table of attributes, which entries refer to by number.
+ * It is in the host's byte order, to be mapped as it is.
+ * At the end are the btrfs directories recorded for -G, with their
+ * NUL-terminated names.
+ *
+ * The names are sorted and front-coded in blocks of NAMEBLOCK: the
+ * first name of a block is stored whole, and each of the others as
+ * the length of the prefix it shares with the one before and the rest
+ * of it; lengths are variable-length integers, 7 bits to the byte.
+ * An entry refers to its name by number, and a table gives where each
+ * block starts, so any name can be had by decoding at most one block.
+ */
+#define	INDEX_MAGIC	"RATINDEX"
+#define	INDEX_VERSION	6
+#define	NAMEBLOCK	16		/* names per front-coded block */
+#define	PATHBUFSIZE	65536		/* for the names of an inode, for -G */
+#define	BLOOMBITS	10		/* filter bits per entry */
+#define	BLOOMK		7		/* bits set per entry */
+
+typedef struct idxhead {
+	char		x_magic[8];	/* INDEX_MAGIC */
+	uint32_t	x_version;	/* INDEX_VERSION */
+	uint32_t	x_bloomk;	/* bits set per entry */
+	uint64_t	x_count;	/* number of entries */
+	uint64_t	x_dbits;	/* bits in the digest filter */
+	uint64_t	x_sbits;	/* bits in the size filter */
+	uint64_t	x_dbloom;	/* offset of the digest filter */
+	uint64_t	x_sbloom;	/* offset of the size filter */
+	uint64_t	x_entries;	/* offset of the entries */
+	uint64_t	x_attrs;	/* offset of the attributes */
+	uint64_t	x_nattrs;	/* number of them */
+	uint64_t	x_idents;	/* offset of the inode order */
+	uint64_t	x_blocks;	/* offset of the block table */
+	uint64_t	x_paths;	/* offset of the coded names */
+	uint64_t	x_pathlen;	/* bytes of coded names */
+	uint64_t	x_roots;	/* offset of the -G directories */
+	uint64_t	x_nroots;	/* number of them */
+	uint64_t	x_rootnames;	/* offset of their names */
+	uint64_t	x_rootnamelen;	/* bytes of names */
+} Idxhead;
+
+/*
+ * A btrfs directory, as of the start of a run with -G.
+ */
+typedef struct idxroot {
+	unsigned char	r_fsid[BTRFS_FSID_SIZE];	/* the filesystem */
+	uint64_t	r_subvol;	/* the subvolume it is in */
+	uint64_t	r_gen;		/* the subvolume's generation */
+	uint64_t	r_name;		/* offset of its absolute name */
+} Idxroot;
+
+typedef struct idxent {
+	unsigned char	e_digest[SHA256_LEN];
+	uint64_t	e_size;		/* st_size */
+	uint64_t	e_ino;		/* st_ino */
+	int64_t		e_mtime;	/* st_mtim, in ns */
+	int64_t		e_ctime;	/* st_ctim, in ns */
+	uint32_t	e_path;		/* number of its name */
+	uint32_t	e_attr;		/* number of its attributes */
+} Idxent;
+
+/*
+ * What many index entries have in common.
+ */
+typedef struct idxattr {
+	uint64_t	a_dev;		/* st_dev */
+	uint32_t	a_uid;		/* st_uid */
+	uint32_t	a_gid;		/* st_gid */
+	uint32_t	a_perms;	/* st_mode & ALLPERMS */
+	uint32_t	a_flags;	/* as follows */
+} Idxattr;
+
+#define	A_SETTLED	0x1		/* not changed for a while when seen */
+
+/*
+ * An entry to be written to the new index, with its name.
+ */
+typedef struct newent {
+	Idxent		n_ent;
+	Idxattr		n_attr;		/* for n_ent.e_attr */
+	char		*n_path;
+	int		n_new;		/* seen on this run */
+} Newent;
+
+/*
+ * A directory we have been into, and the mount we went in through.
+ */
+typedef struct visit {
+	dev_t		v_dev;
+	ino_t		v_ino;
+	uint64_t	v_mnt;
+} Visit;
+
+/*
+ * What we know about each filesystem, for deciding whether its files
+ * can be replaced.
+ */
+typedef struct fsinfo {
+	dev_t		f_dev;		/* device number */
+	int		f_rdonly;	/* mounted read-only */
+	long		f_linkmax;	/* most links a file can have */
+} Fsinfo;
+
+/*
+ * Latency distributions of the system calls on the hot paths, kept
+ * when -S is given.  Each is a log-linear histogram of nanoseconds,
+ * as HdrHistogram does it: values below 2 * LATSUB have a bucket each,
+ * and each power of two above that is split into LATSUB buckets, so
+ * that a value is never more than 1/LATSUB out.  They are kept per
+ * thread, like the scan buffer, so that recording takes no locks, and
+ * added into one by latmerge() when a thread is done.
+ * Directories are timed a getdents64() batch at a time, since readdir()
+ * returns most entries from its buffer without a system call.
+ */
+#define	LAT_READDIR	0
+#define	LAT_STAT	1
+#define	LAT_OPEN	2
+#define	LAT_READ	3
+#define	LAT_RENAME	4
+#define	LAT_LINK	5
+#define	LAT_UNLINK	6
+#define	NLAT		7
+
+#define	DIRBUFSIZE	32768		/* for getdents64() */
+
+#define	LATSUBBITS	4
+#define	LATSUB		(1 << LATSUBBITS)	/* buckets per power of two */
+#define	LATBUCKETS	(2 * LATSUB + (64 - LATSUBBITS - 1) * LATSUB)
+
+typedef struct latency {
+	uint64_t	l_count[NLAT][LATBUCKETS];
+	uint64_t	l_total[NLAT];	/* number recorded */
+	uint64_t	l_max[NLAT];	/* longest */
+} Latency;
+
+/*
+ * Messages for the standard output and error are formatted into a
+ * buffer belonging to the thread, and whole buffers are handed to a
+ * writer thread, so that a slow terminal or a storm of errors doesn't
+ * hold up the scan.  A buffer is handed over when it fills; the writer
+ * sweeps up every thread's buffers each LOGDELAY seconds, so that no
+ * message waits longer than that for one from the same thread to come
+ * after it; and all of them are handed over and written when output
+ * must be in order with what follows (statistics, fatal errors, those
+ * that leave a file behind, or exit).  A thread's buffers are guarded
+ * by its own lock, which is taken after statelock and before loglock.
+ *
+ * Errors about a file are counted by errno and directory; after the
+ * first LOGREPEAT of a kind, the rest are only counted, and summed up
+ * at the end.
+ */
+#define	LOGBUFSIZE	65536
+#define	LOGDELAY	1
+#define	LOGREPEAT	3
+#define	LOGKEYS		4096		/* buckets in the table of kinds */
+
+typedef struct logbuf {
+	struct logbuf	*g_next;	/* next in the queue */
+	int		g_fd;		/* where it is to go */
+	size_t		g_len;		/* bytes in it */
+	time_t		g_started;	/* when its first message came */
+	char		g_data[LOGBUFSIZE];
+} Logbuf;
+
+typedef struct logstate {
+	struct logstate	*s_next;	/* next thread's */
+	pthread_mutex_t	s_lock;
+	Logbuf		*s_bufs[2];	/* for the standard output and error */
+} Logstate;
+
+typedef struct logkey {
+	struct logkey	*k_next;	/* next in its bucket */
+	int		k_errno;
+	char		*k_dir;		/* the directory */
+	unsigned long	k_count;	/* errors of this kind */
+} Logkey;
+
+/*
+ * For -w, the reading done and space freed under each directory
+ * prefix of the files read, kept in an open hash table like visits.
+ */
+#define	WORSTN		20		/* prefixes reported */
+
+typedef struct where {
+	char		*w_prefix;	/* the directory */
+	off_t		w_read;		/* bytes read from files under it */
+	unsigned long	w_compares;	/* compares of files under it */
+	off_t		w_saved;	/* bytes freed under it */
+} Where;
+
+/*
+ * Durability policies for the link phase.
+ */
+#define	SYNC_NONE	0		/* leave it to the system */
+#define	SYNC_DIR	1		/* fsync each directory after its batch */
+#define	SYNC_FS		2		/* syncfs each filesystem at the end */
+
+/*
+ * The digest cache (-x) is an extended attribute on each file holding
+ * the digest of its contents and enough of its inode to tell whether
+ * it is still valid.  It is a fixed-size record, laid out big-endian
+ * at these offsets so that it can be copied between hosts.
+ */
+#define	XATTR_NAME	"user.rat.digest"
+#define	XATTR_VERSION	1
+
+#define	X_VERSION	0		/* one byte: XATTR_VERSION */
+#define	X_ALG		1		/* one byte: ALG_SHA256 */
+#define	X_SIZE		8		/* st_size */
+#define	X_MTIME		16		/* st_mtim, seconds then nanoseconds */
+#define	X_CTIME		32		/* st_ctim when it was hashed */
+#define	X_INO		48		/* st_ino */
+#define	X_STAMP		56		/* time just before it was set */
+#define	X_DIGEST	72		/* the digest itself */
+#define	X_LEN		(X_DIGEST + SHA256_LEN)
+
+#define	STAMP_SLACK	1		/* seconds allowed for our own update */
+#define	XSTAMP_SLACK	10000000L	/* the same, in ns, for the xattr */
+
+/*
+ * How far a file's i_digest can be believed.  A record written on
+ * another inode (a copy) only says what the file held when it was
+ * copied; it can tell files apart, but equal ones must still be
+ * compared.
+ */
+#define	DIG_NONE	0		/* not known */
+#define	DIG_HINT	1		/* from a record on another inode */
+#define	DIG_CACHED	2		/* from a record on this inode */
+#define	DIG_READ	3		/* found from its data on this run */
+
+#define	ALG_SHA256	1
+
+/*
+ * Counts of what happened, for -S.
+ */
+typedef struct stats {
+	atomic_ulong	s_files;	/* files entered in the list */
+	atomic_ulong	s_offline;	/* offline files left alone */
+	atomic_ulong	s_remounts;	/* directories seen via another mount */
+	atomic_ulong	s_loops;	/* directories seen via the same one */
+	unsigned long	s_unlinkable;	/* files that could never be linked */
+	unsigned long	s_fixed;	/* files that could only be kept */
+	unsigned long	s_classes;	/* equivalence classes */
+	unsigned long	s_compares;	/* pairs of files compared */
+	off_t		s_bytesread;	/* bytes read comparing them */
+	unsigned long	s_dirs;		/* directories linked into */
+	unsigned long	s_links;	/* files replaced by links */
+	unsigned long	s_failed;	/* replacements that failed */
+	unsigned long	s_rewritten;	/* of them, files changed since */
+	off_t		s_saved;	/* bytes freed by doing so */
+	unsigned long	s_crcs;		/* files fingerprinted */
+	off_t		s_crcbytes;	/* bytes read doing so */
+	unsigned long	s_crcunique;	/* files set aside as unique */
+	unsigned long	s_hashed;	/* files whose digest we computed */
+	off_t		s_hashbytes;	/* bytes read doing so */
+	unsigned long	s_cachehits;	/* digests found in the cache */
+	unsigned long	s_comparedigests; /* digests found by compare() */
+	unsigned long	s_cachestored;	/* digests written to the cache */
+	unsigned long	s_trusted;	/* links made on digests alone */
+	unsigned long	s_quarantined;	/* files that stalled */
+	unsigned long	s_veritied;	/* fs-verity digests fetched */
+	unsigned long	s_verity;	/* links made on them */
+	unsigned long	s_defrag;	/* keepers chosen for fewer extents */
+	unsigned long	s_idxlookups;	/* files looked up in the index */
+	unsigned long	s_idxsizeneg;	/* turned away by the size filter */
+	unsigned long	s_idxdigestneg;	/* turned away by the digest filter */
+	unsigned long	s_idxsearches;	/* searches of the index proper */
+	unsigned long	s_idxhits;	/* files added to classes from it */
+	unsigned long	s_idxwritten;	/* entries in the new index */
+	unsigned long	s_idxknown;	/* digests taken from it */
+	unsigned long	s_incremental;	/* directories not walked for -G */
+	unsigned long	s_changed;	/* files found changed in them */
+	unsigned long	s_syncs;	/* fsync or syncfs calls */
+	double		s_linktime;	/* seconds spent in the link phase */
+	double		s_synctime;	/* seconds of which spent syncing */
+} Stats;
+
 /*
  * Internal function declarations.
  */
 static	Head	*associate(int, char **);
 static	Head	*assocfromfile(char *);
-static	Head	*enterdir(char *, Head *);
-static	int	enter(char *, char *, Head **);
-static	Head	*assoc(Head *, Head *);
+static	void	enterdir(char *);
+static	int	enter(char *, char *);
+static	void	assoc(Head *);
+static	uint64_t keyhash(Head *);
+static	void	flush(Scanbuf *);
+static	void	insert(Shard *, Head *);
+static	void	grow(Shard *);
+static	Head	*classes(void);
 static	int	newinfo(char *, char *, Head *);
 static	Head	*newhead(void);
-
-static	void	combine(Info *);
+static	int	offline(char *, struct stat *, uint64_t);
+static	int	thinblocks(char *);
+static	int	xstat(char *, int, struct stat *, uint64_t *, uint64_t *);
+static	int	visited(dev_t, ino_t, uint64_t, uint64_t *);
+static	Visit	*visit(dev_t, ino_t, uint64_t);
+static	void	descend(char *);
+static	void	walkroot(char *);
+static	void	walkall(void);
+static	void	*walker(void *);
+
+static	void	combine(Head *);
+static	void	feasible(Head *);
+static	int	unlinkable(Info *, Head *);
+static	Fsinfo	*getfs(dev_t, char *);
+static	void	crcall(Head *);
+static	void	verityall(Head *);
+static	Verity	*measure(char *);
+static	int	veritycmp(Verity *, Verity *);
+static	int	fingerprint(Info *, off_t);
+static	int	crcread(int, off_t, off_t, uint32_t *, char *);
+static	int	crccmp(const void *, const void *);
+static	void	digestall(Head *, int);
+static	int	getcache(Info *, off_t);
+static	void	putcache(int, Info *, struct stat *);
+static	int	hashfile(Info *, off_t);
+static	void	hashinodes(Head *);
+static	void	rehash(Head *);
+static	int	inocmp(const void *, const void *);
+static	int	digcmp(const void *, const void *);
+static	off_t	reclaimable(Head *);
+static	double	sampleclass(Head *, size_t *);
+static	void	estimate(Head *);
+static	int	sizecmp(const void *, const void *);
+static	int	whatifkey(const Member *, const Member *);
+static	int	whatifcmp(const void *, const void *);
+static	void	analyse(Head *);
+static	void	loadindex(char *);
+static	void	indexclass(Head *);
+static	int	bloomtest(unsigned char *, uint64_t, uint64_t, uint64_t);
+static	void	bloomset(unsigned char *, uint64_t, uint64_t, uint64_t);
+static	uint64_t sizekey(uint64_t);
+static	size_t	idxfind(unsigned char *);
+static	Idxattr	*idxattr(Idxent *);
+static	int64_t	nstime(struct timespec *);
+static	int	idxknown(Info *, Head *);
+static	Info	*idxinfo(Idxent *, Head *);
+static	void	writeindex(char *);
+static	int	underwalked(char *, char **);
+static	int	pathcmp(const void *, const void *);
+static	int	entcmp(const void *, const void *);
+static	int	identcmp(const void *, const void *);
+static	size_t	attrslot(Idxattr *, Idxattr *, uint32_t *, size_t);
+static	char	*idxpath(uint64_t);
+static	int	putvar(unsigned char *, uint64_t);
+static	int	getvar(unsigned char **, unsigned char *, uint64_t *);
+static	int	incremental(char *);
+static	int	btrfsroot(int, Idxroot *);
+static	int	changed(int, char *, char *, char *, uint64_t, char **);
+static	int	inodepaths(int, uint64_t, char *, char *, char **);
+static	int	subtrees(int, char *, char *, uint64_t, char ***);
+static	int	mountsunder(char *, char *, char ***, int *);
+static	void	addsubtree(char ***, int *, char *, char *);
 static	Info	*comb2(Info *, Info *);
-static	int	compare(char *, char *);
+static	int	compare(Info *, Info *);
+static	Devtune	*devtune(dev_t);
+static	void	tune(Devtune *, int, double, double);
+static	void	comparedigest(int, Info *, Info *);
+static	void	lastdigest(int, Info *, Sha256 *, char *, ssize_t, off_t);
 static	int	replace(Info *, Info *);
-static	int	replace2(char *, char *);
+static	void	plan(Info *, Head *);
+static	Info	*nextkeeper(Info *, Info *);
+static	void	queue(Info *, Info *, Head *, int);
+static	long	extents(char *);
+static	int	opcmp(const void *, const void *);
+static	void	linkall(void);
+static	int	replace2(Op *, int);
+static	int	unchanged(Op *, int);
+static	void	syncdir(int);
+static	void	syncall(void);
+static	void	report(void);
+static	void	attribute(char *, off_t, int, off_t);
+static	void	wherereport(void);
+static	uint64_t prefixhash(char *, size_t);
+static	int	wherecmp(const void *, const void *);
 
 static	void	raisepriority(void);
 static	void	lowerpriority(void);
 
+static	double	now(void);
+static	uint64_t lattime(void);
+static	void	latency(int, uint64_t);
+static	void	latmerge(void);
+static	int	xfstat(int, struct stat *);
+static	int	latbucket(uint64_t);
+static	uint64_t latvalue(int);
+static	uint64_t percentile(int, double);
+static	int	timedopen(char *);
+static	ssize_t	timedread(int, char *, size_t, off_t, char *);
+static	ssize_t	iowait(int, char *, int, char *, size_t, off_t);
+static	void	*iothread(void *);
+static	void	lostbuf(char *);
+static	uint64_t qhash(char *);
+static	int	quarantined(char *);
+static	void	quarantine(char *, char *);
+static	void	stalled(void);
+static	char	*getbuf(void);
+static	void	putbuf(char *);
+static	void	put64(unsigned char *, uint64_t);
+static	uint64_t get64(unsigned char *);
 static	char	*mkpath(char *, char *);
 static	void	error(int, char *, ...);
 static	void	verror(int, char *, va_list);
 static	void	fatal(char *, ...);
+static	void	patherror(char *, char *, ...);
+static	void	loginit(void);
+static	void	logmsg(int, char *, ...);
+static	void	vlogmsg(int, char *, va_list);
+static	void	loghand(Logbuf *);
+static	void	logflush(void);
+static	void	logsweep(void);
+static	Logstate *mylogstate(void);
+static	void	urgent(int, char *, ...);
+static	void	logsummary(void);
+static	void	*logwriter(void *);
+static	void	writeall(int, char *, size_t);
 
 /*
  * Name of program, for printing error messages.
@@ -171,6 +960,184 @@ static	int	ignore_empty = 0;	/* ignore empty files */
 static	int	debug = 0;		/* debugging level */
 
 static	int	symbolic = 0;		/* follow symlinks to directories */
+static	int	durability = SYNC_NONE;	/* how hard to push links to disk */
+static	int	statistics = 0;		/* print statistics at the end */
+static	int	hashcache = 0;		/* keep digests in extended attributes */
+static	int	trusthash = 0;		/* equal digests mean equal files */
+static	int	crcmode = CRC_NONE;	/* -C: how to fingerprint files */
+static	int	keeper = KEEP_LINKS;	/* -K: which file to keep */
+static	int	hugepages = 0;		/* -H: use huge pages for buffers */
+static	unsigned timeout = 0;		/* -t: seconds allowed for I/O */
+static	int	stubs = 0;		/* -o: include offline files */
+static	char	*indexfile = NULL;	/* -I: the content index */
+static	int	generations = 0;	/* -G: btrfs incremental runs */
+static	int	wheredepth = 0;		/* -w: levels to attribute I/O to */
+
+/*
+ * The index as loaded at the start of the run: the filters are in
+ * memory, the rest is mapped.
+ */
+static	Idxhead	idxhead;
+static	char	*idxmap = NULL;		/* the whole file */
+static	size_t	idxmaplen;
+static	Idxent	*idxents;		/* its entries */
+static	Idxattr	*idxattrs;		/* their attributes */
+static	uint32_t *idxidents;		/* them by device and inode */
+static	uint64_t *idxblocks;		/* where its name blocks start */
+static	Idxroot	*idxroots;		/* its -G directories */
+
+/*
+ * The -G directories seen on this run.
+ */
+static	Idxroot	*newroots = NULL;
+static	char	**newrootnames = NULL;
+static	int	nnewroots = 0;
+
+/*
+ * Every file found by the walk, for writeindex(): combine() takes files
+ * out of their classes as it goes, so the classes can't be used.
+ */
+static	Member	*allfiles = NULL;
+static	size_t	nallfiles = 0;
+
+static	time_t	idxstart;		/* when the walk began */
+static	Newent	*identv;		/* entries being sorted by identcmp */
+static	unsigned char *dbloom = NULL;	/* digest filter */
+static	unsigned char *sbloom = NULL;	/* size filter */
+
+/*
+ * Directories entered so far, as an open-addressed hash table.
+ */
+static	Visit	*visits = NULL;
+static	size_t	nvisits = 0;		/* entries in use */
+static	size_t	maxvisits = 0;		/* size of table; a power of two */
+static	pthread_mutex_t	visitlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The directories waiting to be read, with -j, and how many threads
+ * are reading one (and so may push more).
+ */
+static	int	walkers = 1;		/* -j: threads walking the tree */
+static	char	**walkroots = NULL;	/* directories given, and walked */
+static	int	nwalkroots = 0;
+static	Dirwork	*walkstack = NULL;
+static	int	walkbusy = 0;
+static	pthread_mutex_t	walklock = PTHREAD_MUTEX_INITIALIZER;
+static	pthread_cond_t	walkcond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Where the reading was done, for -w.
+ */
+static	Where	*wheres = NULL;
+static	size_t	nwheres = 0;		/* entries in use */
+static	size_t	maxwheres = 0;		/* size of table; a power of two */
+
+/*
+ * Filesystems seen so far, and the directory we last checked.
+ */
+static	Fsinfo	*fslist = NULL;
+static	int	nfslist = 0;
+static	char	*lastdir = NULL;
+static	int	lastdirok;
+
+/*
+ * For -t, the calling thread's I/O helper, and the files that have
+ * been put in quarantine for stalling, in order and by name.
+ */
+static	_Thread_local Iohelper *iohelper;
+
+static	char	**quarantine_list = NULL;
+static	size_t	nquarantine = 0;
+static	Qentry	*qtable[QBUCKETS];
+
+static	char	*crcnames[] = { "none", "prefix", "sample", "full" };
+
+static	char	*keepnames[] = { "links", "extents" };
+static	int	samples = 0;		/* -e: classes to sample per size */
+static	int	analysis = 0;		/* -a: try all the policies */
+static	int	whatif;			/* the policy being tried */
+
+static	char	*whatnames[W_ALL] = {
+	"none", "-u", "-g", "-ug", "-p", "-up", "-gp", "-ugp"
+};
+
+static	char	*algnames[] = { "none", "sha256" };
+
+static	char	*bynames[] = { "", " by digest sha256", " by fs-verity digest" };
+
+static	char	*syncnames[] = { "none", "dir", "fs" };
+
+static	Stats	stats;			/* what happened */
+
+/*
+ * The read sizes compare() has found best on each device.
+ */
+static	Devtune	*tunes = NULL;
+static	int	ntunes = 0;
+
+/*
+ * For SYNC_FS, a descriptor on each filesystem we have linked into.
+ */
+static	int	*fsfds = NULL;		/* open directories */
+static	dev_t	*fsdevs = NULL;		/* and the devices they are on */
+static	int	nfs = 0;		/* number of them */
+
+/*
+ * The table of classes, and the calling thread's buffer of files
+ * waiting to go into it.
+ */
+static	Shard	shards[NSHARDS] = {
+	[0 ... NSHARDS - 1] = { .t_lock = ATOMIC_FLAG_INIT }
+};
+static	_Thread_local Scanbuf scanbuf;
+
+/*
+ * The calling thread's read buffers.
+ */
+static	_Thread_local Bufpool bufpool;
+
+/*
+ * The calling thread's latency histograms.
+ */
+static	_Thread_local Latency lat;
+
+/*
+ * And those of every thread that has finished with them.
+ */
+static	Latency	alllat;
+static	pthread_mutex_t latlock = PTHREAD_MUTEX_INITIALIZER;
+
+static	char	*latnames[] = {
+	"getdents", "stat", "open", "read", "rename", "link", "unlink"
+};
+
+/*
+ * The calling thread's log buffers, every thread's, and what is shared
+ * with the writer.
+ */
+static	_Thread_local Logstate *logstate;
+static	pthread_mutex_t	statelock = PTHREAD_MUTEX_INITIALIZER;
+static	Logstate *logstates = NULL;
+
+static	pthread_mutex_t	loglock = PTHREAD_MUTEX_INITIALIZER;
+static	pthread_cond_t	logwork = PTHREAD_COND_INITIALIZER;	/* queued */
+static	pthread_cond_t	logidle = PTHREAD_COND_INITIALIZER;	/* all written */
+static	Logbuf	*logqueue = NULL;	/* waiting to be written */
+static	Logbuf	**logtail = &logqueue;
+static	Logbuf	*logfree = NULL;	/* written, to be used again */
+static	int	logbusy = 0;		/* writer has one in hand */
+static	int	logthread = 0;		/* writer is running */
+
+static	pthread_mutex_t	keylock = PTHREAD_MUTEX_INITIALIZER;
+static	Logkey	*logkeys[LOGKEYS];	/* kinds of error seen */
+
+/*
+ * The queue of replacements waiting to be done.
+ */
+static	Op	*ops = NULL;		/* array of pending operations */
+static	size_t	nops = 0;		/* number in use */
+static	size_t	maxops = 0;		/* number allocated */
+static	struct timespec linkstart;	/* when linkall() began */
 
 /*
  * Default directory if no files given.
@@ -180,7 +1147,7 @@ static	char	*dot = ".";
 int
 main(int argc, char *argv[])
 {
-    Head	*list;
+    Head	*list, *hp;
     int		count;
     char	*inputfile = NULL;
 
@@ -189,62 +1156,180 @@ main(int argc, char *argv[])
     /*
      * parse option flags.
      */
-    for (count = 1; count < argc && argv[count][0] == '-'; count++) {
-	int i;
+    while ((count = getopt(argc, argv, "vnrsugpzf:dD:SxTC:Hot:K:I:Gj:w:e:a")) != -1) {
+	switch (count) {
+	case 'v':		/* say what we are doing */
+	    verbose = 1;
+	    break;
+
+	case 'n':		/* don't do anything */
+	    noexec = 1;
+	    verbose = 1;
+	    break;
+
+	case 'r':		/* recursive mode */
+	    recursive = 1;
+	    break;
+
+	case 's':		/* follow symlinks */
+	    symbolic = 1;
+	    break;
+
+	case 'u':		/* ignore ownership info */
+	    ignore_uid = 1;
+	    break;
+
+	case 'g':		/* ignore group ownership info */
+	    ignore_gid = 1;
+	    break;
+
+	case 'p':		/* ignore permissions info */
+	    ignore_perms = 1;
+	    break;
+
+	case 'z':		/* ignore empty files */
+	    ignore_empty = 1;
+	    break;
+
+	case 'f':		/* read list of filenames from file */
+	    inputfile = optarg;
+	    break;
+
+	case 'd':		/* debug - undocumented */
+	    debug = 1;
+	    break;
+
+	case 'D':		/* durability of links */
+	    for (durability = SYNC_FS; durability > SYNC_NONE; durability--) {
+		if (strcmp(optarg, syncnames[durability]) == 0) {
+		    break;
+		}
+	    }
+	    if (durability == SYNC_NONE && strcmp(optarg, "none") != 0) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
 
-	for (i = 1; argv[count][i] != '\0'; i++) {
-	    switch (argv[count][i]) {
-	    case 'v':		/* say what we are doing */
-		verbose = 1;
-		break;
+	case 'S':		/* print statistics */
+	    statistics = 1;
+	    break;
 
-	    case 'n':		/* don't do anything */
-		noexec = 1;
-		verbose = 1;
-		break;
+	case 'x':		/* cache digests in extended attributes */
+	    hashcache = 1;
+	    break;
 
-	    case 'r':		/* recursive mode */
-		recursive = 1;
-		break;
+	case 'T':		/* don't verify matching digests */
+	    trusthash = 1;
+	    break;
 
-	    case 's':		/* follow symlinks */
-		symbolic = 1;
-		break;
+	case 'C':		/* fingerprint with CRC-32C */
+	    for (crcmode = CRC_FULL; crcmode > CRC_NONE; crcmode--) {
+		if (strcmp(optarg, crcnames[crcmode]) == 0) {
+		    break;
+		}
+	    }
+	    if (crcmode == CRC_NONE) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
 
-	    case 'u':		/* ignore ownership info */
-		ignore_uid = 1;
-		break;
+	case 'H':		/* huge pages for read buffers */
+	    hugepages = 1;
+	    break;
 
-	    case 'g':		/* ignore group ownership info */
-		ignore_gid = 1;
-		break;
+	case 'o':		/* include offline files */
+	    stubs = 1;
+	    break;
 
-	    case 'p':		/* ignore permissions info */
-		ignore_perms = 1;
-		break;
+	case 't':		/* deadline for each open and read */
+	    timeout = atoi(optarg);
+	    if (timeout == 0) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
 
-	    case 'z':		/* ignore empty files */
-		ignore_empty = 1;
-		break;
+	case 'G':		/* btrfs incremental runs */
+	    generations = 1;
+	    break;
 
-	    case 'f':		/* read list of filenames from file */
-		if (count + 1 < argc) {
-		    inputfile = argv[count + 1];
-		} else {
-		    (void) fputs(USAGE, stderr);
+	case 'K':		/* how to choose the file kept */
+	    for (keeper = KEEP_EXTENTS; keeper > KEEP_LINKS; keeper--) {
+		if (strcmp(optarg, keepnames[keeper]) == 0) {
+		    break;
 		}
-		break;
+	    }
+	    if (keeper == KEEP_LINKS && strcmp(optarg, "links") != 0) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
 
-	    case 'd':		/* debug - undocumented */
-		debug = 1;
-		break;
+	case 'I':		/* keep a content index */
+	    indexfile = optarg;
+	    break;
+
+	case 'j':		/* walk with several threads */
+	    walkers = atoi(optarg);
+	    if (walkers < 1) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
+
+	case 'w':		/* say where the reading went */
+	    wheredepth = atoi(optarg);
+	    if (wheredepth <= 0) {
+		(void) fputs(USAGE, stderr);
+		exit(1);
+	    }
+	    break;
 
-	    default:
+	case 'a':		/* analyse the effects of -ugpz */
+	    analysis = 1;
+	    break;
+
+	case 'e':		/* estimate the savings by sampling */
+	    samples = atoi(optarg);
+	    if (samples < 2) {
 		(void) fputs(USAGE, stderr);
 		exit(1);
 	    }
+	    break;
+
+	default:
+	    (void) fputs(USAGE, stderr);
+	    exit(1);
 	}
     }
+    count = optind;
+
+    if (generations && indexfile == NULL) {
+	(void) fputs(USAGE, stderr);
+	exit(1);
+    }
+
+    loginit();
+
+    /*
+     * -a classifies files as finely as possible, so that it can
+     * then work out what each of the relaxations would do.
+     */
+    if (analysis) {
+	ignore_uid = ignore_gid = ignore_perms = ignore_empty = 0;
+    }
+
+    /*
+     * -G needs the index before the walk.  A file whose change time
+     * is much before the walk began can be taken to have been seen
+     * as it is now.
+     */
+    if (indexfile != NULL) {
+	loadindex(indexfile);
+	idxstart = time(NULL);
+    }
 
     /*
      * Read all the files into an associativity list, and then
@@ -259,9 +1344,58 @@ main(int argc, char *argv[])
 	list = associate(argc - count, argv + count);
     }
 
-    while (list != NULL) {
-	combine(list->h_info);
-	list = list->h_next;
+    /*
+     * With -a or -e, just say what we would have done.
+     */
+    if (analysis || samples > 0) {
+	if (analysis) {
+	    analyse(list);
+	} else {
+	    estimate(list);
+	}
+	logsummary();
+	stalled();
+	logflush();
+	if (statistics) {
+	    report();
+	}
+	if (wheredepth > 0) {
+	    wherereport();
+	}
+	return(0);
+    }
+
+    /*
+     * With -I, hash everything, and add the files from the index that
+     * might match to their classes.
+     */
+    if (indexfile != NULL) {
+	for (hp = list; hp != NULL; hp = hp->h_next) {
+	    indexclass(hp);
+	}
+    }
+
+    for (hp = list; hp != NULL; hp = hp->h_next) {
+	combine(hp);
+    }
+
+    /*
+     * Now do the replacements, a directory at a time.
+     */
+    linkall();
+
+    if (indexfile != NULL && !noexec) {
+	writeindex(indexfile);
+    }
+
+    logsummary();
+    stalled();
+    logflush();
+    if (statistics) {
+	report();
+    }
+    if (wheredepth > 0) {
+	wherereport();
     }
 
     /*
@@ -278,7 +1412,6 @@ static Head *
 associate(int argc, char *argv[])
 {
     register int count;		/* loop counter */
-    Head *list = NULL;		/* pointer to linked list */
 
     if (debug) {
 	(void) puts("associate");
@@ -289,12 +1422,14 @@ associate(int argc, char *argv[])
 	 * If we encounter a directory,
 	 * call enterdir to handle it.
 	 */
-	if (enter(argv[count], ".", &list) == ISDIR) {
-	    list = enterdir(argv[count], list);
+	if (enter(argv[count], ".") == ISDIR && !incremental(argv[count])) {
+	    walkroot(argv[count]);
+	    descend(argv[count]);
 	}
     }
+    walkall();
 
-    return(list);
+    return(classes());
 }
 
 /*
@@ -305,7 +1440,6 @@ static Head *
 assocfromfile(char *filename)
 {
     FILE	*infile;
-    Head	*list = NULL;		/* pointer to linked list */
     char	buf[256];
     int		lineno;
 
@@ -339,81 +1473,250 @@ assocfromfile(char *filename)
 	 * If we encounter a directory,
 	 * call enterdir to handle it.
 	 */
-	if (enter(buf, ".", &list) == ISDIR) {
-	    list = enterdir(buf, list);
+	if (enter(buf, ".") == ISDIR) {
+	    if ((s = strdup(buf)) == NULL) {
+		fatal("Out of memory");
+	    }
+	    walkroot(s);
+	    descend(s);
 	}
     }
+    walkall();
 
     (void) fclose(infile);
 
-    return(list);
+    return(classes());
 }
 
 /*
- * Given a directory name and a linked list, add the files
- * within the directory to the list, and return the new list.
+ * Given a directory name, add the files within the directory
+ * to the class table.
  * Recurse if directories are encountered and "-r" has been given.
  */
-static Head *
-enterdir(dirname, list)
+static void
+enterdir(dirname)
 char *dirname;
-Head *list;
 {
-	DIR *dirp;		/* open directory pointer */
-	struct dirent *dp;	/* pointer to each directory entry */
+	int fd;			/* the open directory */
+	char *buf;		/* a batch of its entries */
+	ssize_t n, off;		/* bytes of them, and how far through */
+	struct dirent64 *dp;	/* pointer to each directory entry */
+	struct stat stbuf;	/* what the directory is */
+	uint64_t mnt;		/* and the mount we reached it by */
+	uint64_t seen;		/* the mount it was seen through before */
+	long entries = 0;	/* how many it had */
+	uint64_t start;		/* when a batch was asked for */
 
 	if (debug) {
 		(void) printf("enterdir(%s)\n", dirname);
 	}
+	PROBE1(dir__enter, dirname);
+
+	/*
+	 * Don't go into the same directory twice.
+	 */
+	if (xstat(dirname, 0, &stbuf, &mnt, NULL) == 0
+	  && visited(stbuf.st_dev, stbuf.st_ino, mnt, &seen)) {
+		if (seen != mnt) {
+			stats.s_remounts++;
+		} else {
+			stats.s_loops++;
+		}
+		if (debug) {
+			(void) printf("already been in %s\n", dirname);
+		}
+		PROBE2(dir__exit, dirname, -1L);
+		return;
+	}
 
 	/*
 	 * Open the directory.
 	 */
-	dirp = opendir(dirname);
-	if (dirp == NULL) {
-		error(1, "cannot open directory %s", dirname);
-		return(list);
+	fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		patherror(dirname, "cannot open directory %s", dirname);
+		PROBE2(dir__exit, dirname, -1L);
+		return;
+	}
+	buf = malloc(DIRBUFSIZE);
+	if (buf == NULL) {
+		fatal("Out of memory");
 	}
 
 	/*
 	 * Search the directory, ignoring only "." and "..".
 	 */
-	while ((dp = readdir(dirp)) != NULL) {
-		if (strcmp(dp->d_name, ".") == 0
-		  || strcmp(dp->d_name, "..") == 0) {
-			continue;		/* skip self and parent */
+	for (;;) {
+		start = lattime();
+		n = getdents64(fd, buf, DIRBUFSIZE);
+		latency(LAT_READDIR, start);
+		if (n <= 0) {
+			if (n == -1) {
+				patherror(dirname, "cannot read directory %s",
+								dirname);
+			}
+			break;
 		}
+		for (off = 0; off < n; off += dp->d_reclen) {
+			dp = (struct dirent64 *) (buf + off);
+			if (strcmp(dp->d_name, ".") == 0
+			  || strcmp(dp->d_name, "..") == 0) {
+				continue;	/* skip self and parent */
+			}
+			entries++;
 
-		/*
-		 * If we encounter a directory, ignore it,
-		 * unless the -r flag has been given.
-		 */
-		if (enter(dp->d_name, dirname, &list) == ISDIR && recursive) {
-			list = enterdir(mkpath(dirname, dp->d_name), list);
+			/*
+			 * If we encounter a directory, ignore it,
+			 * unless the -r flag has been given.
+			 */
+			if (enter(dp->d_name, dirname) == ISDIR && recursive) {
+				descend(mkpath(dirname, dp->d_name));
+			}
 		}
 	}
 
 	/*
 	 * Close the directory.
 	 */
-	(void) closedir(dirp);
-
-	return(list);
+	(void) close(fd);
+	free(buf);
+	PROBE2(dir__exit, dirname, entries);
 }
 
 /*
- * Enter the file in the given associativity list.
- * A file may be entered in an existing class only
- * if its size, device number, ownership and permissions are the same.
- * Returns ISDIR if a directory is encountered,
+ * Note that a directory named by the user is to be walked, so that the
+ * index can forget the files in it that aren't found.
+ */
+static void
+walkroot(dirname)
+char *dirname;
+{
+	walkroots = (char **) realloc(walkroots,
+					(nwalkroots + 1) * sizeof(char *));
+	if (walkroots == NULL) {
+		fatal("Out of memory");
+	}
+	walkroots[nwalkroots++] = dirname;
+}
+
+/*
+ * Go into a directory: at once, or with -j by pushing it for one of
+ * the walking threads to read.
+ */
+static void
+descend(dirname)
+char *dirname;
+{
+	register Dirwork *dp;
+
+	if (walkers == 1) {
+		enterdir(dirname);
+		return;
+	}
+
+	dp = (Dirwork *) malloc(sizeof(Dirwork));
+	if (dp == NULL) {
+		fatal("Out of memory");
+	}
+	dp->d_name = dirname;
+
+	(void) pthread_mutex_lock(&walklock);
+	dp->d_next = walkstack;
+	walkstack = dp;
+	(void) pthread_cond_signal(&walkcond);
+	(void) pthread_mutex_unlock(&walklock);
+}
+
+/*
+ * With -j, read all the directories pushed by descend(), and those
+ * found in them, with that many threads, and wait for them to finish.
+ * They take no signals, like the log writer.
+ */
+static void
+walkall()
+{
+	pthread_t *tids;
+	sigset_t all, old;
+	register int i, n;
+
+	if (walkstack == NULL) {
+		return;
+	}
+
+	tids = (pthread_t *) malloc(walkers * sizeof(pthread_t));
+	if (tids == NULL) {
+		fatal("Out of memory");
+	}
+	(void) sigfillset(&all);
+	(void) pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (n = 0; n < walkers; n++) {
+		if (pthread_create(&tids[n], NULL, walker, NULL) != 0) {
+			break;
+		}
+	}
+	(void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (n == 0) {
+		(void) walker(NULL);	/* no threads: do it ourselves */
+	}
+	for (i = 0; i < n; i++) {
+		(void) pthread_join(tids[i], NULL);
+	}
+	free(tids);
+}
+
+/*
+ * A walking thread: read directories until there are none left and
+ * no thread is reading one, then put what is left in this thread's
+ * buffers where the main thread will find it.
+ */
+static void *
+walker(void *arg)
+{
+	register Dirwork *dp;
+
+	(void) arg;
+
+	(void) pthread_mutex_lock(&walklock);
+	for (;;) {
+		while (walkstack == NULL && walkbusy > 0) {
+			(void) pthread_cond_wait(&walkcond, &walklock);
+		}
+		if (walkstack == NULL) {
+			break;
+		}
+		dp = walkstack;
+		walkstack = dp->d_next;
+		walkbusy++;
+		(void) pthread_mutex_unlock(&walklock);
+
+		enterdir(dp->d_name);
+		free(dp);
+
+		(void) pthread_mutex_lock(&walklock);
+		walkbusy--;
+	}
+	(void) pthread_cond_broadcast(&walkcond);
+	(void) pthread_mutex_unlock(&walklock);
+
+	flush(&scanbuf);
+	logflush();
+	latmerge();
+
+	return(NULL);
+}
+
+/*
+ * Enter the file in the class table.
+ * A file may be entered in an existing class only
+ * if its size, device number, ownership and permissions are the same.
+ * Returns ISDIR if a directory is encountered,
  * and NOTDIR for successfully entered files.
- * Side-effects *listp.	(NASTY).
  */
 static int
-enter(filename, directory, listp)
+enter(filename, directory)
 char *filename;
 char *directory;
-Head **listp;
 {
 	Head head;
 
@@ -432,37 +1735,124 @@ Head **listp;
 		return(ISDIR);
 	}
 
-	*listp = assoc(&head, *listp);
+	assoc(&head);
 
 	return(NOTDIR);
 }
 
 /*
- * Given a reference to a file, and an associativity list,
- * enter the file in an appropriate equivalence class.
- *
- * We have to return the list we are given, in case it is
- * empty to start with and we create a new element.
+ * Given a reference to a file, queue it to be entered in an
+ * appropriate equivalence class.  It goes in this thread's buffer,
+ * which is only shared with other threads when it is full.
  */
-static Head *
-assoc(hp, list)
+static void
+assoc(hp)
 Head *hp;				/* file to be entered */
-Head *list;				/* list to put it in */
+{
+	if (debug) {
+		(void) puts("assoc");
+	}
+
+	hp->h_hash = keyhash(hp);
+	scanbuf.b_heads[scanbuf.b_count++] = *hp;
+	if (scanbuf.b_count == SCANBUF) {
+		flush(&scanbuf);
+	}
+}
+
+/*
+ * Hash the parts of a file's description that decide its class.
+ */
+static uint64_t
+keyhash(hp)
+Head *hp;
+{
+	uint64_t h;
+
+	h = (uint64_t) hp->h_size;
+	h = h * 0x9e3779b97f4a7c15ULL + (uint64_t) hp->h_dev;
+	h = h * 0x9e3779b97f4a7c15ULL + hp->h_mnt;
+	h = h * 0x9e3779b97f4a7c15ULL + (ignore_uid ? 0 : hp->h_uid);
+	h = h * 0x9e3779b97f4a7c15ULL + (ignore_gid ? 0 : hp->h_gid);
+	h = h * 0x9e3779b97f4a7c15ULL + (ignore_perms ? 0 : hp->h_perms);
+
+	/*
+	 * Finish by mixing the high bits down and the low bits up,
+	 * since both the shard and the bucket come from them.
+	 */
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+
+	return(h);
+}
+
+/*
+ * Put the files in a scan buffer into their classes.  The shards are
+ * visited in turn, each locked once for all of the buffer's files that
+ * belong to it.
+ */
+static void
+flush(bp)
+Scanbuf *bp;
+{
+	unsigned char which[SCANBUF];	/* shard of each entry */
+	uint64_t pending = 0;		/* shards with entries */
+	register Shard *sp;
+	register int i, s;
+
+	for (i = 0; i < bp->b_count; i++) {
+		which[i] = bp->b_heads[i].h_hash >> (64 - SHARDBITS);
+		pending |= (uint64_t) 1 << which[i];
+	}
+
+	for (s = 0; s < NSHARDS; s++) {
+		if (!(pending & ((uint64_t) 1 << s))) {
+			continue;
+		}
+		sp = &shards[s];
+		while (atomic_flag_test_and_set_explicit(&sp->t_lock,
+						memory_order_acquire)) {
+			;		/* spin */
+		}
+		for (i = 0; i < bp->b_count; i++) {
+			if (which[i] == s) {
+				insert(sp, &bp->b_heads[i]);
+			}
+		}
+		atomic_flag_clear_explicit(&sp->t_lock, memory_order_release);
+	}
+
+	bp->b_count = 0;
+}
+
+/*
+ * Enter a file in its class in the given shard, which is locked,
+ * making a new class if it is unlike any we have already seen.
+ */
+static void
+insert(sp, hp)
+Shard *sp;
+Head *hp;
 {
 	register Head *listp;		/* current list element */
 	register Head *hptr;		/* temp header structure */
+	Head **bucket;
 
-	if (debug) {
-		(void) puts("assoc");
+	if (sp->t_count >= sp->t_nbuckets) {
+		grow(sp);
 	}
+	bucket = &sp->t_buckets[hp->h_hash & (sp->t_nbuckets - 1)];
 
-	for (listp = list; listp != NULL; listp = listp->h_next) {
+	for (listp = *bucket; listp != NULL; listp = listp->h_chain) {
 		/*
 		 * If the file will fit into this class,
-		 * insert it and return list.
+		 * insert it and return.
 		 */
-		if (hp->h_size == listp->h_size &&
+		if (hp->h_hash == listp->h_hash &&
+		    hp->h_size == listp->h_size &&
 		     hp->h_dev == listp->h_dev &&
+		     hp->h_mnt == listp->h_mnt &&
 		    (ignore_uid || hp->h_uid == listp->h_uid) &&
 		    (ignore_gid || hp->h_gid == listp->h_gid) &&
 		    (ignore_perms || hp->h_perms == listp->h_perms)) {
@@ -475,45 +1865,171 @@ Head *list;				/* list to put it in */
 
 			hp->h_info->i_next = listp->h_info;
 			listp->h_info = hp->h_info;
-			return(list);
+			return;
 		}
 	}
 
 	/*
 	 * If we have not found an appropriate class into which
-	 * this file may be inserted, push a new element on to
-	 * the head of the list.
+	 * this file may be inserted, make a new one.
 	 */
 	hptr = newhead();
-	hptr->h_info = hp->h_info;
-	hptr->h_size = hp->h_size;
-	hptr->h_dev = hp->h_dev;
-	hptr->h_uid = hp->h_uid;
-	hptr->h_gid = hp->h_gid;
-	hptr->h_perms = hp->h_perms;
-	hptr->h_next = list;
-	return(hptr);
+	*hptr = *hp;
+	PROBE3(class__new, (long long) hp->h_size, (long long) hp->h_dev,
+							hp->h_hash);
+	hptr->h_chain = *bucket;
+	*bucket = hptr;
+
+	hptr->h_next = NULL;
+	if (sp->t_tail == NULL) {
+		sp->t_list = hptr;
+	} else {
+		sp->t_tail->h_next = hptr;
+	}
+	sp->t_tail = hptr;
+	sp->t_count++;
+}
+
+/*
+ * Double the number of buckets in a shard, which is locked.
+ */
+static void
+grow(sp)
+Shard *sp;
+{
+	Head **buckets;
+	size_t n;
+	register Head *hp;
+
+	n = sp->t_nbuckets ? sp->t_nbuckets * 2 : NBUCKETS;
+	buckets = (Head **) calloc(n, sizeof(Head *));
+	if (buckets == NULL) {
+		fatal("Out of memory");
+	}
+
+	for (hp = sp->t_list; hp != NULL; hp = hp->h_next) {
+		hp->h_chain = buckets[hp->h_hash & (n - 1)];
+		buckets[hp->h_hash & (n - 1)] = hp;
+	}
+
+	free(sp->t_buckets);
+	sp->t_buckets = buckets;
+	sp->t_nbuckets = n;
+}
+
+/*
+ * The scan is over: put what is left in the buffer into the table,
+ * and return all the classes as a single list.
+ */
+static Head *
+classes()
+{
+	Head *list = NULL, *tail = NULL;
+	register int s;
+	register Head *hp;
+	register Info *ip;
+
+	flush(&scanbuf);
+
+	for (s = 0; s < NSHARDS; s++) {
+		if (shards[s].t_list == NULL) {
+			continue;
+		}
+		if (tail == NULL) {
+			list = shards[s].t_list;
+		} else {
+			tail->h_next = shards[s].t_list;
+		}
+		tail = shards[s].t_tail;
+		stats.s_classes += shards[s].t_count;
+	}
+
+	/*
+	 * With -I, remember every file for the index.
+	 */
+	if (indexfile != NULL) {
+		for (hp = list; hp != NULL; hp = hp->h_next) {
+			for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+				nallfiles++;
+			}
+		}
+		allfiles = (Member *) malloc((nallfiles + 1) * sizeof(Member));
+		if (allfiles == NULL) {
+			fatal("Out of memory");
+		}
+		nallfiles = 0;
+		for (hp = list; hp != NULL; hp = hp->h_next) {
+			for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+				allfiles[nallfiles].m_info = ip;
+				allfiles[nallfiles].m_head = hp;
+				nallfiles++;
+			}
+		}
+	}
+
+	return(list);
 }
 
 /*
- * Given an equivalence list,
+ * Given an equivalence class,
  * combine together all files which are identical.
  */
 static void
-combine(list)
-Info *list;
+combine(hp)
+Head *hp;
 {
+	Info *list = hp->h_info;
+	Info *elem;
+
 	if (debug) {
 		(void) puts("combine");
 	}
 
+	if (list != NULL && list->i_next != NULL) {
+		feasible(hp);
+		list = hp->h_info;
+	}
+
+	if (list != NULL && list->i_next != NULL) {
+		verityall(hp);
+	}
+
+	/*
+	 * Look up the digests that are known without reading anything
+	 * before fingerprinting, which is only worth doing if some file
+	 * still lacks one.
+	 */
+	if ((hashcache || idxhead.x_count > 0)
+	  && list != NULL && list->i_next != NULL) {
+		digestall(hp, 0);
+	}
+
+	for (elem = list; elem != NULL; elem = elem->i_next) {
+		if (elem->i_hashed == DIG_NONE && elem->i_verity == NULL) {
+			break;
+		}
+	}
+	if (crcmode != CRC_NONE && elem != NULL
+	  && list != NULL && list->i_next != NULL) {
+		crcall(hp);
+		list = hp->h_info;
+	}
+
+	if (trusthash && list != NULL && list->i_next != NULL) {
+		digestall(hp, 1);
+	}
+
 	while (list != NULL && list->i_next != NULL) {
-		list = comb2(list, list->i_next);
+		elem = list;
+		list = comb2(elem, elem->i_next);
+		plan(elem, hp);
 	}
 }
 
 /*
  * Attempt to combine the file given with each file in the given list.
+ * Files identical to elem are moved from the list on to elem's i_same
+ * chain; the list of those left over is returned.
  *
  * comb2 a [] = []
  * comb2 a (b:x) = comb2 a x, replace a b
@@ -542,372 +2058,4740 @@ Info *ilist;
 
 /*
  * Given two files, decide if they are identical,
- * and if so, try and replace one with a link to the other.
+ * and if so, add the second to the group of files identical to the first.
  * we don't have to worry about ownership at this stage,
  * as this should already have been decided.
  *
- * Returns 1 if the files were linked, or are
- * already linked, or cannot be linked due to
- * a problem, and 0 if the files are different.
+ * Returns 1 if the files are identical or already linked,
+ * and 0 if the files are different.
  *
  * replace a b = TRUE, linked a b	(a and b are already linked)
- *               FALSE, ~ compare a b
- *               TRUE, replace2 a b \/ replace2 b a	(side-effect)
- *               TRUE
+ *               FALSE, fixed a /\ fixed b
+ *               FALSE, crc a /= crc b
+ *               FALSE, digest a /= digest b
+ *               FALSE, ~ trusthash /\ ~ compare a b
+ *               TRUE, a.same := b:a.same	(side-effect)
  */
 static int
 replace(a, b)
 Info *a;
 Info *b;
 {
-	struct stat stbuf_a, stbuf_b;
-
 	if (debug) {
 		(void) puts("replace");
 	}
 
 	/*
 	 * If the inode numbers are identical, they are already
-	 * linked, so return 1 as if we had linked them.
+	 * linked, so there is no need to look at their contents.
 	 * The device numbers must be the same to get this far.
 	 */
-	if (a->i_ino == b->i_ino) {
-		return(1);
-	}
+	if (a->i_ino != b->i_ino) {
+		/*
+		 * If neither can be replaced, don't bother reading them.
+		 */
+		if (a->i_fixed && b->i_fixed) {
+			return(0);
+		}
 
-	/*
-	 * Different contents; return false.
-	 */
-	if (compare(a->i_name, b->i_name) != 0) {
-		return(0);
-	}
+		/*
+		 * Different fingerprints or digests mean different contents.
+		 */
+		if (a->i_crcok && b->i_crcok && a->i_crc != b->i_crc) {
+			return(0);
+		}
 
-	/*
-	 * Delete and replace the file with the lower link count.
-	 */
-	if (lstat(a->i_name, &stbuf_a) == -1) {
-		fprintf(stderr, "Cannot restat %s\n", a->i_name);
-		return(0);
-	}
-	if (lstat(b->i_name, &stbuf_b) == -1) {
-		fprintf(stderr, "Cannot restat %s\n", b->i_name);
-		return(0);
-	}
-	if (stbuf_b.st_nlink <= stbuf_a.st_nlink) {
-		replace2(a->i_name, b->i_name);
-	} else {
-		replace2(b->i_name, a->i_name);
+		if (a->i_verity != NULL && b->i_verity != NULL) {
+			switch (veritycmp(a->i_verity, b->i_verity)) {
+			case 0:
+				b->i_trusted = BY_VERITY;
+				break;
+			case 1:
+				return(0);
+			}
+		}
+
+		if (a->i_hashed && b->i_hashed) {
+			if (memcmp(a->i_digest, b->i_digest, SHA256_LEN) != 0) {
+				return(0);
+			}
+
+			/*
+			 * With -T, the same digest means the same contents,
+			 * as long as both were found from the data itself
+			 * on this run: a cached one could have been forged.
+			 */
+			if (trusthash && !b->i_trusted
+			  && a->i_hashed == DIG_READ
+			  && b->i_hashed == DIG_READ) {
+				b->i_trusted = BY_DIGEST;
+			}
+		}
+
+		/*
+		 * Different contents; return false.
+		 */
+		if (!b->i_trusted && compare(a, b) != 0) {
+			return(0);
+		}
 	}
 
-	/*
-	 * Return 1 here - it is irrelevant whether we succeeded or not.
-	 */
+	b->i_same = a->i_same;
+	a->i_same = b;
+
 	return(1);
 }
 
 /*
- * This is the nasty bit; we musn't ever lose files here.
- *
- * Replace the second filename with a link to the first.
- * Returns 0 for failure, 1 for success, -1 for catastrophic
- * failure (i.e. one of the files may have been lost)
+ * Check, before reading any of them, which files in a class could be
+ * replaced by links.  Files that could never be linked at all are
+ * taken out of the class; those that could be kept but not replaced
+ * are marked i_fixed.  If nothing in the class could be replaced,
+ * the class is emptied.
  */
-static int
-replace2(from, to)
-char *from, *to;
+static void
+feasible(hp)
+Head *hp;
 {
-	char newname[1024];		/* save file name */
-	time_t clock;			/* time for temp file name */
+	register Info *ip, **ipp;
+	int replaceable = 0;
+
+	for (ipp = &hp->h_info; (ip = *ipp) != NULL; ) {
+		if (unlinkable(ip, hp)) {
+			stats.s_unlinkable++;
+			*ipp = ip->i_next;
+			continue;
+		}
+		if (ip->i_fixed) {
+			stats.s_fixed++;
+		} else {
+			replaceable++;
+		}
+		ipp = &ip->i_next;
+	}
 
-	if (debug) {
-		(void) printf("replace2(%s, %s)\n", from, to);
+	if (replaceable == 0) {
+		hp->h_info = NULL;
 	}
+}
 
-	/*
-	 * If -n has been given, just print commands.
-	 */
-	if (noexec) {
-		(void) printf("link %s to %s\n", to, from);
+/*
+ * Decide whether a file in the given class could ever be part of a
+ * link: not if its filesystem is read-only, nor if it is immutable or
+ * append-only, since then it can neither be removed nor linked to.
+ * Returns 1 if not; otherwise returns 0, having set i_fixed if its
+ * directory would stop us renaming or removing it.
+ */
+static int
+unlinkable(ip, hp)
+Info *ip;
+Head *hp;
+{
+	Fsinfo *fp;
+	struct stat stbuf;
+	uint64_t mnt;			/* for xstat() */
+	struct statx stx;
+	char *dir, *cp;
+	size_t len;
+	int fd, flags;
+
+	fp = getfs(hp->h_dev, ip->i_name);
+	if (fp->f_rdonly) {
 		return(1);
 	}
 
 	/*
-	 * Before we throw "to" away, relink it to a temporary file.
+	 * statx() can tell us without opening the file; if the filesystem
+	 * doesn't say, ask it directly.
 	 */
-	(void) time(&clock);
-	(void) sprintf(newname, "%s%4.4x%4.4x", to,
-						(unsigned) (getpid() & 0xffff),
-						(unsigned) clock & 0xffff);
-
-	if (debug) {
-		(void) puts("replace2 - creating save file");
+	if (statx(AT_FDCWD, ip->i_name, 0, 0, &stx) == 0
+	  && (stx.stx_attributes_mask & (STATX_ATTR_IMMUTABLE|STATX_ATTR_APPEND))
+				== (STATX_ATTR_IMMUTABLE|STATX_ATTR_APPEND)) {
+		if (stx.stx_attributes & (STATX_ATTR_IMMUTABLE|STATX_ATTR_APPEND)) {
+			return(1);
+		}
+	} else {
+		fd = open(ip->i_name, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+		if (fd != -1) {
+			if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0
+			  && (flags & (FS_IMMUTABLE_FL | FS_APPEND_FL))) {
+				(void) close(fd);
+				return(1);
+			}
+			(void) close(fd);
+		}
 	}
 
 	/*
-	 * Set priority high so that anyone trying to access the files
-	 * will be less likely to notice their disappearance.
-	 * We must be careful to lower it again afterwards.
+	 * To replace it we must be able to write its directory and,
+	 * if that is sticky, own the directory or the name itself (for
+	 * a symlink, the link rather than what it points to).  Files in a
+	 * directory tend to come together, so remember the last one.
 	 */
-	raisepriority();
+	cp = strrchr(ip->i_name, '/');
+	if (cp == NULL) {
+		dir = dot;
+		len = strlen(dot);
+	} else {
+		dir = ip->i_name;
+		len = cp == ip->i_name ? 1 : cp - ip->i_name;	/* "/" */
+	}
+	if (lastdir == NULL || strlen(lastdir) != len
+	  || strncmp(dir, lastdir, len) != 0) {
+		free(lastdir);
+		lastdir = strndup(dir, len);
+		if (lastdir == NULL) {
+			fatal("Out of memory");
+		}
+		lastdirok = faccessat(AT_FDCWD, lastdir, W_OK | X_OK,
+							AT_EACCESS) == 0
+			 && xstat(lastdir, 0, &stbuf, &mnt, NULL) == 0;
+		if (lastdirok && (stbuf.st_mode & S_ISVTX) && geteuid() != 0
+		  && geteuid() != stbuf.st_uid) {
+			lastdirok = -1;		/* need to own the file */
+		}
+	}
 
-	if (rename(to, newname) == -1) {	/* cannot save file */
-		if (debug) {
-			error(1, "rename('%s', '%s')", to, newname);
+	ip->i_fixed = lastdirok == 0
+		   || (lastdirok == -1 && geteuid() != ip->i_uid);
+
+	return(0);
+}
+
+/*
+ * Find out about the filesystem on device dev, on which is the named file.
+ */
+static Fsinfo *
+getfs(dev, name)
+dev_t dev;
+char *name;
+{
+	struct statvfs vfs;
+	register Fsinfo *fp;
+	register int i;
+
+	for (i = 0; i < nfslist; i++) {
+		if (fslist[i].f_dev == dev) {
+			return(&fslist[i]);
 		}
-		lowerpriority();
-		return(0);
 	}
 
-	/*
-	 * Now try and link them together.
-	 */
-	if (debug) {
-		(void) puts("replace2 - linking");
+	fslist = (Fsinfo *) realloc(fslist, (nfslist + 1) * sizeof(Fsinfo));
+	if (fslist == NULL) {
+		fatal("Out of memory");
 	}
+	fp = &fslist[nfslist++];
 
-	if (link(from, to) == -1) {
-		if (rename(newname, to) == -1) {
+	fp->f_dev = dev;
+	fp->f_rdonly = statvfs(name, &vfs) == 0 && (vfs.f_flag & ST_RDONLY);
+	fp->f_linkmax = pathconf(name, _PC_LINK_MAX);
+	if (fp->f_linkmax <= 0) {
+		fp->f_linkmax = LONG_MAX;	/* no limit */
+	}
+
+	return(fp);
+}
+
+/*
+ * Fingerprint with CRC-32C every file in a class whose digest isn't
+ * known, and take out of the class any of those whose fingerprint
+ * matches no other, since it can't be identical to any of them; only
+ * the rest go on to be hashed or compared.  Files whose digests are
+ * known aren't read: a file that matches none of the others must
+ * still be hashed to show it differs from those too, and is kept if
+ * any file has only an fs-verity digest, which can't be compared
+ * with it.  Files that couldn't be fingerprinted are left in.
+ */
+static void
+crcall(hp)
+Head *hp;
+{
+	register Info *ip;
+	Info **v;			/* the files */
+	size_t n, i, k;			/* how many of them */
+	size_t nknown = 0;		/* of them, with a digest */
+	size_t nverity = 0;		/* or only a verity digest */
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		if (ip->i_hashed != DIG_NONE) {
+			nknown++;
+		} else if (ip->i_verity != NULL) {
+			nverity++;
+		} else {
+			(void) fingerprint(ip, hp->h_size);
+		}
+		n++;
+	}
+
+	v = (Info **) malloc(n * sizeof(Info *));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		v[n++] = ip;
+	}
+	qsort(v, n, sizeof(Info *), crccmp);
+
+	/*
+	 * Rebuild the class from those that share a fingerprint, or
+	 * might match a file that has none.
+	 */
+	hp->h_info = NULL;
+	for (i = n; i-- > 0; ) {
+		if (v[i]->i_crcok && nverity == 0
+		  && (i == 0 || !v[i - 1]->i_crcok || v[i - 1]->i_crc != v[i]->i_crc)
+		  && (i == n - 1 || v[i + 1]->i_crc != v[i]->i_crc)) {
+			if (nknown == 0) {
+				stats.s_crcunique++;
+				continue;
+			}
+			if (hashfile(v[i], hp->h_size) == 0) {
+				for (k = 0; k < n; k++) {
+					if (k != i && v[k]->i_hashed != DIG_NONE
+					  && memcmp(v[k]->i_digest, v[i]->i_digest,
+							SHA256_LEN) == 0) {
+						break;
+					}
+				}
+				if (k == n) {
+					stats.s_crcunique++;
+					continue;
+				}
+			}
+		}
+		v[i]->i_next = hp->h_info;
+		hp->h_info = v[i];
+	}
+
+	free(v);
+}
+
+/*
+ * Fetch the fs-verity digest of each file in a class that has one.
+ */
+static void
+verityall(hp)
+Head *hp;
+{
+	register Info *ip;
+
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		if (ip->i_isverity && ip->i_verity == NULL) {
+			ip->i_verity = measure(ip->i_name);
+		}
+	}
+}
+
+/*
+ * Ask the kernel for the fs-verity digest of the named file, and how
+ * it was made, if it can say (from Linux 5.12).  Nothing is read.
+ * Returns NULL if the file has no digest.
+ */
+static Verity *
+measure(name)
+char *name;
+{
+	struct {
+		struct fsverity_digest	d;
+		unsigned char		buf[VERITY_MAXDIGEST];
+	} m;
+	struct fsverity_descriptor desc;
+	struct fsverity_read_metadata_arg arg;
+	register Verity *vp;
+	int fd;
+
+	fd = timedopen(name);
+	if (fd == -1) {
+		return(NULL);
+	}
+	(void) memset(&m, 0, sizeof(m));
+	m.d.digest_size = VERITY_MAXDIGEST;
+	if (ioctl(fd, FS_IOC_MEASURE_VERITY, &m) == -1
+	  || m.d.digest_size > VERITY_MAXDIGEST) {
+		(void) close(fd);
+		return(NULL);
+	}
+
+	vp = (Verity *) calloc(1, sizeof(Verity));
+	if (vp == NULL) {
+		fatal("Out of memory");
+	}
+	vp->y_alg = m.d.digest_algorithm;
+	vp->y_len = m.d.digest_size;
+	(void) memcpy(vp->y_digest, m.d.digest, m.d.digest_size);
+
+	(void) memset(&arg, 0, sizeof(arg));
+	arg.metadata_type = FS_VERITY_METADATA_TYPE_DESCRIPTOR;
+	arg.offset = 0;
+	arg.length = sizeof(desc);
+	arg.buf_ptr = (uintptr_t) &desc;
+	if (ioctl(fd, FS_IOC_READ_VERITY_METADATA, &arg) >= (int) offsetof(
+				struct fsverity_descriptor, __reserved)
+	  && desc.salt_size <= VERITY_MAXSALT) {
+		vp->y_params = 1;
+		vp->y_logbs = desc.log_blocksize;
+		vp->y_saltlen = desc.salt_size;
+		(void) memcpy(vp->y_salt, desc.salt, desc.salt_size);
+	}
+	(void) close(fd);
+
+	stats.s_veritied++;
+	return(vp);
+}
+
+/*
+ * Compare two fs-verity digests.  Returns 0 if the files are identical,
+ * 1 if they are different, and -1 if we can't tell.
+ */
+static int
+veritycmp(a, b)
+Verity *a, *b;
+{
+	if (a->y_alg != b->y_alg || a->y_len != b->y_len) {
+		return(-1);
+	}
+	if (memcmp(a->y_digest, b->y_digest, a->y_len) == 0) {
+		return(0);
+	}
+	if (a->y_params && b->y_params && a->y_logbs == b->y_logbs
+	  && a->y_saltlen == b->y_saltlen
+	  && memcmp(a->y_salt, b->y_salt, a->y_saltlen) == 0) {
+		return(1);
+	}
+	return(-1);
+}
+
+/*
+ * Order files by fingerprint, those without one first.
+ */
+static int
+crccmp(const void *a, const void *b)
+{
+	const Info *ia = *(Info * const *) a;
+	const Info *ib = *(Info * const *) b;
+
+	if (ia->i_crcok != ib->i_crcok) {
+		return(ia->i_crcok - ib->i_crcok);
+	}
+	if (ia->i_crc != ib->i_crc) {
+		return(ia->i_crc < ib->i_crc ? -1 : 1);
+	}
+	return(0);
+}
+
+/*
+ * Compute the CRC-32C fingerprint of a file of the given size,
+ * over as much of it as -C says.
+ * Returns 0 if all went well, -1 if it could not be read.
+ */
+static int
+fingerprint(ip, size)
+Info *ip;
+off_t size;
+{
+	int fd;
+	uint32_t crc = 0;
+	off_t off;
+	register int i;
+	int ok = 0;
+
+	fd = timedopen(ip->i_name);
+	if (fd == -1) {
+		return(-1);
+	}
+
+	switch (crcmode) {
+	case CRC_PREFIX:
+		ok = crcread(fd, 0, min(size, PREFIXLEN), &crc, ip->i_name);
+		break;
+
+	case CRC_SAMPLE:
+		if (size <= NSAMPLES * SAMPLELEN) {
+			ok = crcread(fd, 0, size, &crc, ip->i_name);
+			break;
+		}
+		/*
+		 * Evenly spaced blocks, the first at the start
+		 * and the last at the end.
+		 */
+		for (i = 0; i < NSAMPLES; i++) {
+			off = (size - SAMPLELEN) / (NSAMPLES - 1) * i;
+			if (i == NSAMPLES - 1) {
+				off = size - SAMPLELEN;
+			}
+			ok = crcread(fd, off, SAMPLELEN, &crc, ip->i_name);
+			if (ok != 0) {
+				break;
+			}
+		}
+		break;
+
+	case CRC_FULL:
+		ok = crcread(fd, 0, size, &crc, ip->i_name);
+		break;
+	}
+
+	(void) close(fd);
+
+	if (ok != 0) {
+		return(-1);
+	}
+
+	ip->i_crc = crc;
+	ip->i_crcok = 1;
+	stats.s_crcs++;
+
+	return(0);
+}
+
+/*
+ * Continue the CRC *crcp over len bytes of fd, which is open on "name",
+ * starting at off.
+ * Returns 0, or -1 if they could not all be read.
+ */
+static int
+crcread(fd, off, len, crcp, name)
+int fd;
+off_t off;
+off_t len;
+uint32_t *crcp;
+char *name;
+{
+	char *buf;
+	ssize_t n;
+
+	buf = getbuf();
+	while (len > 0) {
+		n = timedread(fd, buf, min(len, (off_t) HASHREAD), off, name);
+		if (n <= 0) {
+			putbuf(buf);
+			return(-1);
+		}
+		*crcp = crc32c(*crcp, buf, n);
+		stats.s_crcbytes += n;
+		if (wheredepth > 0) {
+			attribute(name, n, 0, 0);
+		}
+		off += n;
+		len -= n;
+	}
+	putbuf(buf);
+	return(0);
+}
+
+/*
+ * Find the digest of every file in a class.
+ * The cached digests are all fetched first, in one pass over the class,
+ * so that the extended attributes are read together while the inodes
+ * are still hot from the walk, and none of the data reads that follow
+ * get in between; then, if "all" is set, the files without one are
+ * read and hashed.  Otherwise they are left to compare(), which finds
+ * the digest of files that turn out to be identical as it reads them.
+ * With -T, files whose cached digest matches another's are hashed
+ * again too, as only digests read on this run are trusted.
+ */
+static void
+digestall(hp, all)
+Head *hp;
+int all;
+{
+	register Info *ip;
+
+	if (hashcache) {
+		for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+			if (!ip->i_hashed && getcache(ip, hp->h_size)) {
+				stats.s_cachehits++;
+			}
+		}
+	}
+
+	if (idxhead.x_count > 0) {
+		for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+			if (ip->i_hashed < DIG_CACHED && ip->i_verity == NULL
+			  && idxknown(ip, hp)) {
+				stats.s_idxknown++;
+			}
+		}
+	}
+
+	if (!all) {
+		return;
+	}
+	hashinodes(hp);
+
+	if (trusthash) {
+		rehash(hp);
+	}
+}
+
+/*
+ * Hash every file in a class that has no digest yet, reading each
+ * inode once however many names it has: the others are given the
+ * digest of whichever name was read.
+ */
+static void
+hashinodes(hp)
+Head *hp;
+{
+	register Info *ip;
+	Info **v;			/* the files, by inode */
+	Info *best;			/* the name whose digest is best known */
+	size_t n, i, j, k;
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		n++;
+	}
+	v = (Info **) malloc(n * sizeof(Info *));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		v[n++] = ip;
+	}
+	qsort(v, n, sizeof(Info *), inocmp);
+
+	for (i = 0; i < n; i = j) {
+		best = v[i];
+		for (j = i + 1; j < n && v[j]->i_ino == v[i]->i_ino; j++) {
+			if (v[j]->i_hashed > best->i_hashed) {
+				best = v[j];
+			}
+		}
+		for (k = i; best->i_hashed < DIG_CACHED && k < j; k++) {
+			if (v[k]->i_verity == NULL
+			  && hashfile(v[k], hp->h_size) == 0) {
+				best = v[k];
+			}
+		}
+		if (best->i_hashed < DIG_CACHED) {
+			continue;
+		}
+		for (k = i; k < j; k++) {
+			if (v[k]->i_hashed < best->i_hashed) {
+				(void) memcpy(v[k]->i_digest, best->i_digest,
+								SHA256_LEN);
+				v[k]->i_hashed = best->i_hashed;
+			}
+		}
+	}
+
+	free(v);
+}
+
+/*
+ * Hash again every file in a class whose digest was taken from a cache
+ * but matches that of another inode in the class, so that -T can trust
+ * the match.  Files whose cached digests match no other are left alone.
+ */
+static void
+rehash(hp)
+Head *hp;
+{
+	register Info *ip;
+	Info **v;			/* the hashed files */
+	size_t n, i, j;
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		n++;
+	}
+	v = (Info **) malloc(n * sizeof(Info *));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		if (ip->i_hashed != DIG_NONE) {
+			v[n++] = ip;
+		}
+	}
+
+	qsort(v, n, sizeof(Info *), digcmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++) {
+			if (memcmp(v[j]->i_digest, v[i]->i_digest,
+							SHA256_LEN) != 0) {
+				break;
+			}
+		}
+		if (v[j - 1]->i_ino == v[i]->i_ino) {
+			continue;		/* only one inode has it */
+		}
+		for (; i < j; i++) {
+			if (v[i]->i_hashed == DIG_READ) {
+				continue;
+			}
+			if (i > 0 && v[i - 1]->i_ino == v[i]->i_ino
+			  && v[i - 1]->i_hashed == DIG_READ) {
+				/* another name of the inode just read */
+				(void) memcpy(v[i]->i_digest,
+					v[i - 1]->i_digest, SHA256_LEN);
+				v[i]->i_hashed = DIG_READ;
+			} else {
+				(void) hashfile(v[i], hp->h_size);
+			}
+		}
+	}
+
+	free(v);
+}
+
+/*
+ * Look for a valid cached digest of the given file, whose size is "size".
+ * The record must match the file's size and modification time.  If the
+ * file is the very inode the record was written on, its change time must
+ * also be no later than the moment the record was written; setting the
+ * record itself changes it a moment later, hence XSTAMP_SLACK, so a
+ * write within that moment that restores the modification time goes
+ * unseen.  On a copy (e.g. one made by "rsync -X" on another host) the
+ * change time can't be expected to match, and size and modification
+ * time are easily made to, so the digest is only a hint (DIG_HINT).
+ * Returns 1 and fills in i_digest if one was found, 0 if not.
+ */
+static int
+getcache(ip, size)
+Info *ip;
+off_t size;
+{
+	unsigned char rec[X_LEN];
+	struct timespec ts;
+
+	if (getxattr(ip->i_name, XATTR_NAME, rec, sizeof(rec)) != X_LEN) {
+		return(0);
+	}
+
+	if (rec[X_VERSION] != XATTR_VERSION || rec[X_ALG] != ALG_SHA256
+	  || get64(rec + X_SIZE) != (uint64_t) size
+	  || get64(rec + X_MTIME) != (uint64_t) ip->i_mtime.tv_sec
+	  || get64(rec + X_MTIME + 8) != (uint64_t) ip->i_mtime.tv_nsec) {
+		return(0);
+	}
+
+	if (get64(rec + X_INO) != (uint64_t) ip->i_ino) {
+		(void) memcpy(ip->i_digest, rec + X_DIGEST, SHA256_LEN);
+		ip->i_hashed = DIG_HINT;
+		return(1);
+	}
+
+	ts.tv_sec = get64(rec + X_STAMP);
+	ts.tv_nsec = get64(rec + X_STAMP + 8) + XSTAMP_SLACK;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	if (ip->i_ctime.tv_sec > ts.tv_sec
+	  || (ip->i_ctime.tv_sec == ts.tv_sec
+	    && ip->i_ctime.tv_nsec > ts.tv_nsec)) {
+		return(0);
+	}
+
+	(void) memcpy(ip->i_digest, rec + X_DIGEST, SHA256_LEN);
+	ip->i_hashed = DIG_CACHED;
+
+	return(1);
+}
+
+/*
+ * Record the digest of the file open on fd, whose inode is described
+ * by stp, in its extended attribute.  Failure (no permission, or no
+ * support from the filesystem) is not an error; the file just isn't
+ * cached.  -n, -a and -e mean we don't write anything (not even the
+ * change time), so nothing is cached.
+ */
+static void
+putcache(fd, ip, stp)
+int fd;
+Info *ip;
+struct stat *stp;
+{
+	unsigned char rec[X_LEN];
+	struct timespec ts;
+
+	if (noexec || analysis || samples > 0) {
+		return;
+	}
+
+	(void) memset(rec, 0, sizeof(rec));
+	rec[X_VERSION] = XATTR_VERSION;
+	rec[X_ALG] = ALG_SHA256;
+	put64(rec + X_SIZE, stp->st_size);
+	put64(rec + X_MTIME, stp->st_mtim.tv_sec);
+	put64(rec + X_MTIME + 8, stp->st_mtim.tv_nsec);
+	put64(rec + X_CTIME, stp->st_ctim.tv_sec);
+	put64(rec + X_CTIME + 8, stp->st_ctim.tv_nsec);
+	put64(rec + X_INO, stp->st_ino);
+	(void) memcpy(rec + X_DIGEST, ip->i_digest, SHA256_LEN);
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	put64(rec + X_STAMP, ts.tv_sec);
+	put64(rec + X_STAMP + 8, ts.tv_nsec);
+
+	if (fsetxattr(fd, XATTR_NAME, rec, sizeof(rec), 0) == 0) {
+		stats.s_cachestored++;
+	}
+}
+
+/*
+ * Read the given file, whose size should be "size", and compute the
+ * digest of its contents; cache it if -x was given.
+ * Returns 0 if all went well, -1 if the file could not be read or has
+ * changed since we first looked at it.
+ */
+static int
+hashfile(ip, size)
+Info *ip;
+off_t size;
+{
+	int fd;				/* file descriptor */
+	ssize_t n;			/* count of bytes read */
+	off_t total = 0;		/* and in all */
+	struct stat stbuf;		/* what it is now */
+	Sha256 ctx;			/* the digest so far */
+	char *buf;			/* read buffer */
+
+	fd = timedopen(ip->i_name);
+	if (fd == -1) {
+		return(-1);
+	}
+
+	if (xfstat(fd, &stbuf) == -1 || stbuf.st_size != size
+	  || stbuf.st_ino != ip->i_ino) {
+		(void) close(fd);
+		return(-1);
+	}
+
+	sha256init(&ctx);
+	buf = getbuf();
+	while ((n = timedread(fd, buf, HASHREAD, -1, ip->i_name)) > 0) {
+		sha256update(&ctx, buf, n);
+		total += n;
+	}
+	putbuf(buf);
+	stats.s_hashbytes += total;
+	if (wheredepth > 0) {
+		attribute(ip->i_name, total, 0, 0);
+	}
+
+	if (n < 0 || total != size) {
+		(void) close(fd);
+		return(-1);
+	}
+
+	sha256final(&ctx, ip->i_digest);
+	ip->i_hashed = DIG_READ;
+	stats.s_hashed++;
+
+	if (hashcache) {
+		putcache(fd, ip, &stbuf);
+	}
+
+	(void) close(fd);
+
+	return(0);
+}
+
+/*
+ * Order files by inode number.
+ */
+static int
+inocmp(const void *a, const void *b)
+{
+	const Info *ia = *(Info * const *) a;
+	const Info *ib = *(Info * const *) b;
+
+	if (ia->i_ino == ib->i_ino) {
+		return(0);
+	}
+	return(ia->i_ino < ib->i_ino ? -1 : 1);
+}
+
+/*
+ * Order files by digest, then by inode number.
+ */
+static int
+digcmp(const void *a, const void *b)
+{
+	const Info *ia = *(Info * const *) a;
+	const Info *ib = *(Info * const *) b;
+	int diff;
+
+	diff = memcmp(ia->i_digest, ib->i_digest, SHA256_LEN);
+	if (diff == 0 && ia->i_ino != ib->i_ino) {
+		diff = ia->i_ino < ib->i_ino ? -1 : 1;
+	}
+	return(diff);
+}
+
+/*
+ * Given a class whose files have been hashed, return how much space
+ * would be freed by linking together all those with the same digest,
+ * counting as plan() would: the inode with the most links is kept, and
+ * each other file frees its size if that was its only link.
+ */
+static off_t
+reclaimable(hp)
+Head *hp;
+{
+	register Info *ip;
+	Info **v;			/* the hashed files */
+	size_t n, i, j, k;		/* how many of them */
+	size_t keep;			/* the one kept of those */
+	off_t extra = 0;		/* files that would be freed */
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		n++;
+	}
+	v = (Info **) malloc(n * sizeof(Info *));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		if (ip->i_hashed) {
+			v[n++] = ip;
+		}
+	}
+
+	qsort(v, n, sizeof(Info *), digcmp);
+	for (i = 0; i < n; i = j) {
+		keep = i;
+		for (j = i + 1; j < n; j++) {
+			if (memcmp(v[j]->i_digest, v[i]->i_digest,
+							SHA256_LEN) != 0) {
+				break;
+			}
+			if (v[j]->i_nlink > v[keep]->i_nlink) {
+				keep = j;
+			}
+		}
+		for (k = i; k < j; k++) {
+			if (v[k]->i_ino != v[keep]->i_ino
+			  && v[k]->i_nlink == 1) {
+				extra++;
+			}
+		}
+	}
+
+	free(v);
+
+	return(extra * hp->h_size);
+}
+
+/*
+ * Hash a class, or, if it has more than CLASSSAMPLE files, a random
+ * CLASSSAMPLE of them, and return the space linking them would free,
+ * scaled up to the whole class.  A file in a sample only counts if a
+ * duplicate of it was sampled too, so for big classes this is low;
+ * *partial is counted up when that happens.
+ */
+static double
+sampleclass(hp, partial)
+Head *hp;
+size_t *partial;
+{
+	register Info *ip;
+	Info **v;			/* the files of the class */
+	size_t n, m, i, j;
+	Head sample;			/* the ones chosen */
+	double y;
+
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		n++;
+	}
+	if (n <= CLASSSAMPLE) {
+		digestall(hp, 1);
+		return((double) reclaimable(hp));
+	}
+
+	v = (Info **) malloc(n * sizeof(Info *));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	n = 0;
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		v[n++] = ip;
+	}
+
+	(*partial)++;
+	m = CLASSSAMPLE;
+	for (i = 0; i < m; i++) {
+		j = i + random() % (n - i);
+		ip = v[i];
+		v[i] = v[j];
+		v[j] = ip;
+	}
+
+	/*
+	 * Link the sample up as a class of its own, then put the
+	 * whole class back together.
+	 */
+	sample = *hp;
+	for (i = 0; i < n; i++) {
+		v[i]->i_next = i + 1 == m || i + 1 == n ? NULL : v[i + 1];
+	}
+	sample.h_info = v[0];
+	digestall(&sample, 1);
+	y = (double) reclaimable(&sample) * n / m;
+	v[m - 1]->i_next = v[m];
+	hp->h_info = v[0];
+
+	free(v);
+
+	return(y);
+}
+
+/*
+ * Estimate how much space a full run would free, without reading
+ * every candidate.  The classes that could hold duplicates are divided
+ * into strata by the power of two of their file size, since big files
+ * both cost more to read and count for more; from each stratum,
+ * "samples" classes are chosen at random and hashed (see sampleclass()
+ * for classes too big to hash whole), and the space
+ * they would free is extrapolated to the whole stratum.  The strata
+ * are summed and a 95% confidence interval given from the variance
+ * within each one; if any class was too big to hash whole, only its
+ * lower end means anything.
+ */
+static void
+estimate(list)
+Head *list;
+{
+	Head **strata[NSTRATA];		/* classes of each size */
+	size_t nclass[NSTRATA];		/* and how many */
+	size_t total = 0, sampled = 0;	/* classes in all, and sampled */
+	size_t partial = 0;		/* classes only partly hashed */
+	double sum = 0, var = 0;	/* estimate and its variance */
+	double y, mean, ss;		/* per-stratum figures */
+	double lower;			/* of the confidence interval */
+	register Head *hp;
+	register int h;
+	size_t i, j, n;
+	off_t size;
+
+	(void) memset(nclass, 0, sizeof(nclass));
+	(void) memset(strata, 0, sizeof(strata));
+	srandom((unsigned) time(NULL) ^ (unsigned) getpid());
+
+	/*
+	 * Sort the classes into their strata.  Classes of one file, or of
+	 * empty files, can't free anything.
+	 */
+	for (hp = list; hp != NULL; hp = hp->h_next) {
+		if (hp->h_size == 0 || hp->h_info->i_next == NULL) {
+			continue;
+		}
+		for (h = 0, size = hp->h_size; size > 1; size >>= 1) {
+			h++;
+		}
+		if ((nclass[h] & (nclass[h] - 1)) == 0) {
+			strata[h] = (Head **) realloc(strata[h],
+				(nclass[h] ? nclass[h] * 2 : 1) * sizeof(Head *));
+			if (strata[h] == NULL) {
+				fatal("Out of memory");
+			}
+		}
+		strata[h][nclass[h]++] = hp;
+		total++;
+	}
+
+	for (h = 0; h < NSTRATA; h++) {
+		if (nclass[h] == 0) {
+			continue;
+		}
+		n = min(nclass[h], (size_t) samples);
+
+		/*
+		 * Pick n of them at random, by shuffling them to the front.
+		 */
+		for (i = 0; i < n; i++) {
+			j = i + random() % (nclass[h] - i);
+			hp = strata[h][i];
+			strata[h][i] = strata[h][j];
+			strata[h][j] = hp;
+		}
+
+		mean = ss = 0;
+		for (i = 0; i < n; i++) {
+			y = sampleclass(strata[h][i], &partial);
+			mean += y;
+			ss += y * y;
+		}
+		mean /= n;
+		sum += mean * nclass[h];
+		sampled += n;
+
+		/*
+		 * Variance of the stratum total, with the finite
+		 * population correction; zero if we looked at all of them.
+		 */
+		if (n > 1 && n < nclass[h]) {
+			ss = (ss - n * mean * mean) / (n - 1);
+			var += (double) nclass[h] * nclass[h]
+				* (1 - (double) n / nclass[h]) * ss / n;
+		}
+		free(strata[h]);
+	}
+
+	(void) printf("%lu classes could hold duplicates; %lu sampled, %lld bytes read\n",
+			(unsigned long) total, (unsigned long) sampled,
+			(long long) stats.s_hashbytes);
+	lower = sum - Z95 * sqrt(var) > 0 ? sum - Z95 * sqrt(var) : 0;
+	if (partial == 0) {
+		(void) printf("estimated %.0f bytes reclaimable, 95%% confidence %.0f to %.0f\n",
+				sum, lower, sum + Z95 * sqrt(var));
+		return;
+	}
+
+	/*
+	 * The classes that were only partly hashed are counted low by
+	 * an amount we can't tell, so there is no upper bound.
+	 */
+	(void) printf("estimated at least %.0f bytes reclaimable, 95%% confidence at least %.0f\n",
+			sum, lower);
+	(void) printf("(%lu classes of more than %d files were only partly hashed)\n",
+			(unsigned long) partial, CLASSSAMPLE);
+}
+
+/*
+ * Order classes by device and size.
+ */
+static int
+sizecmp(const void *a, const void *b)
+{
+	const Head *ha = *(Head * const *) a;
+	const Head *hb = *(Head * const *) b;
+
+	if (ha->h_dev != hb->h_dev) {
+		return(ha->h_dev < hb->h_dev ? -1 : 1);
+	}
+	if (ha->h_mnt != hb->h_mnt) {
+		return(ha->h_mnt < hb->h_mnt ? -1 : 1);
+	}
+	if (ha->h_size != hb->h_size) {
+		return(ha->h_size < hb->h_size ? -1 : 1);
+	}
+	return(0);
+}
+
+/*
+ * Compare two files by the key they would be classified on under the
+ * policy "whatif".
+ */
+static int
+whatifkey(ma, mb)
+const Member *ma, *mb;
+{
+	const Head *ha = ma->m_head, *hb = mb->m_head;
+
+	if (ha->h_dev != hb->h_dev) {
+		return(ha->h_dev < hb->h_dev ? -1 : 1);
+	}
+	if (ha->h_mnt != hb->h_mnt) {
+		return(ha->h_mnt < hb->h_mnt ? -1 : 1);
+	}
+	if (ha->h_size != hb->h_size) {
+		return(ha->h_size < hb->h_size ? -1 : 1);
+	}
+	if (!(whatif & W_UID) && ha->h_uid != hb->h_uid) {
+		return(ha->h_uid < hb->h_uid ? -1 : 1);
+	}
+	if (!(whatif & W_GID) && ha->h_gid != hb->h_gid) {
+		return(ha->h_gid < hb->h_gid ? -1 : 1);
+	}
+	if (!(whatif & W_PERMS) && ha->h_perms != hb->h_perms) {
+		return(ha->h_perms < hb->h_perms ? -1 : 1);
+	}
+	return(0);
+}
+
+/*
+ * Order files by their key under "whatif", then by digest and inode
+ * number, so that runs of equal keys and digests are the groups that
+ * would be linked.
+ */
+static int
+whatifcmp(const void *a, const void *b)
+{
+	const Member *ma = (const Member *) a;
+	const Member *mb = (const Member *) b;
+	int diff;
+
+	diff = whatifkey(ma, mb);
+	if (diff == 0) {
+		diff = digcmp(&ma->m_info, &mb->m_info);
+	}
+	return(diff);
+}
+
+/*
+ * Report how many files would be linked, and how much space freed,
+ * under every combination of -u, -g and -p, with and without -z,
+ * reading each file at most once.  The files have been classified
+ * on all of size, device, owner, group and permissions; every file
+ * that shares its size and device with another, whatever its class,
+ * is hashed, and then for each policy the files are sorted on the
+ * parts of the key that policy keeps and the digest.
+ */
+static void
+analyse(list)
+Head *list;
+{
+	Head **classes;			/* all the classes */
+	Member *v;			/* all the hashed files */
+	size_t nclasses, nfiles;	/* how many of each */
+	size_t i, j, k;
+	size_t keep;			/* the file kept of a run */
+	register Head *hp;
+	register Info *ip;
+	unsigned char empty[SHA256_LEN];/* digest of nothing */
+	unsigned long files, zfiles;	/* files linked, without and with -z */
+	off_t bytes;			/* space freed */
+	Sha256 ctx;
+
+	sha256init(&ctx);
+	sha256final(&ctx, empty);
+
+	nclasses = nfiles = 0;
+	for (hp = list; hp != NULL; hp = hp->h_next) {
+		nclasses++;
+	}
+	classes = (Head **) malloc((nclasses + 1) * sizeof(Head *));
+	if (classes == NULL) {
+		fatal("Out of memory");
+	}
+	nclasses = 0;
+	for (hp = list; hp != NULL; hp = hp->h_next) {
+		classes[nclasses++] = hp;
+	}
+	qsort(classes, nclasses, sizeof(Head *), sizecmp);
+
+	/*
+	 * Hash every file whose size and device match some other file's.
+	 * Empty files needn't be read.
+	 */
+	for (i = 0; i < nclasses; i = j) {
+		for (j = i + 1; j < nclasses; j++) {
+			if (sizecmp(&classes[i], &classes[j]) != 0) {
+				break;
+			}
+		}
+		if (j == i + 1 && classes[i]->h_info->i_next == NULL) {
+			continue;		/* the only one of its size */
+		}
+		for (k = i; k < j; k++) {
+			if (classes[k]->h_size > 0) {
+				digestall(classes[k], 1);
+				continue;
+			}
+			for (ip = classes[k]->h_info; ip != NULL; ip = ip->i_next) {
+				(void) memcpy(ip->i_digest, empty, SHA256_LEN);
+				ip->i_hashed = DIG_READ;
+			}
+		}
+	}
+
+	for (i = 0; i < nclasses; i++) {
+		for (ip = classes[i]->h_info; ip != NULL; ip = ip->i_next) {
+			nfiles += ip->i_hashed != DIG_NONE;
+		}
+	}
+	v = (Member *) malloc((nfiles + 1) * sizeof(Member));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	nfiles = 0;
+	for (i = 0; i < nclasses; i++) {
+		for (ip = classes[i]->h_info; ip != NULL; ip = ip->i_next) {
+			if (ip->i_hashed) {
+				v[nfiles].m_info = ip;
+				v[nfiles].m_head = classes[i];
+				nfiles++;
+			}
+		}
+	}
+
+	(void) printf("%-8s %12s %16s %12s\n", "options", "files", "bytes", "files (-z)");
+	for (whatif = 0; whatif < W_ALL; whatif++) {
+		qsort(v, nfiles, sizeof(Member), whatifcmp);
+
+		/*
+		 * In a run of equal keys and digests, the inode with the
+		 * most links is kept, as plan() would, and each of the
+		 * others would be replaced; only those with no other
+		 * link free their space, as reclaimable() counts.
+		 */
+		files = zfiles = 0;
+		bytes = 0;
+		for (i = 0; i < nfiles; i = j) {
+			keep = i;
+			for (j = i + 1; j < nfiles; j++) {
+				if (whatifkey(&v[i], &v[j]) != 0
+				  || memcmp(v[i].m_info->i_digest,
+					v[j].m_info->i_digest, SHA256_LEN) != 0) {
+					break;
+				}
+				if (v[j].m_info->i_nlink > v[keep].m_info->i_nlink) {
+					keep = j;
+				}
+			}
+			for (k = i; k < j; k++) {
+				if (v[k].m_info->i_ino == v[keep].m_info->i_ino
+				  || (k > i && v[k - 1].m_info->i_ino
+						== v[k].m_info->i_ino)) {
+					continue;	/* kept, or counted */
+				}
+				files++;
+				if (v[k].m_head->h_size > 0) {
+					zfiles++;
+				}
+				if (v[k].m_info->i_nlink == 1) {
+					bytes += v[k].m_head->h_size;
+				}
+			}
+		}
+
+		(void) printf("%-8s %12lu %16lld %12lu\n", whatnames[whatif],
+			files, (long long) bytes, zfiles);
+	}
+
+	free(v);
+	free(classes);
+}
+
+/*
+ * Load the index left by the last run, if there is one.
+ */
+static void
+loadindex(name)
+char *name;
+{
+	int fd;
+	struct stat stbuf;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			error(1, "cannot open index %s", name);
+		}
+		return;
+	}
+
+	if (xfstat(fd, &stbuf) == -1
+	  || read(fd, &idxhead, sizeof(idxhead)) != sizeof(idxhead)
+	  || memcmp(idxhead.x_magic, INDEX_MAGIC, sizeof(idxhead.x_magic)) != 0
+	  || idxhead.x_version != INDEX_VERSION
+	  || idxhead.x_count > UINT32_MAX || idxhead.x_nattrs > UINT32_MAX
+	  || idxhead.x_entries + idxhead.x_count * sizeof(Idxent)
+						!= idxhead.x_attrs
+	  || idxhead.x_attrs + idxhead.x_nattrs * sizeof(Idxattr)
+						!= idxhead.x_blocks
+	  || idxhead.x_blocks + (idxhead.x_count + NAMEBLOCK - 1) / NAMEBLOCK
+						* sizeof(uint64_t)
+						!= idxhead.x_idents
+	  || idxhead.x_idents + idxhead.x_count * sizeof(uint32_t)
+						!= idxhead.x_paths
+	  || idxhead.x_paths + idxhead.x_pathlen != idxhead.x_roots
+	  || idxhead.x_roots + idxhead.x_nroots * sizeof(Idxroot)
+						!= idxhead.x_rootnames
+	  || idxhead.x_rootnames + idxhead.x_rootnamelen
+						!= (uint64_t) stbuf.st_size) {
+		error(0, "%s is not an index; ignoring it", name);
+		(void) close(fd);
+		idxhead.x_count = 0;
+		return;
+	}
+
+	/*
+	 * The filters are read in, since they are consulted for every
+	 * file; the entries and names are mapped, since most of them
+	 * won't be looked at.
+	 */
+	dbloom = malloc(idxhead.x_dbits / 8 + 1);
+	sbloom = malloc(idxhead.x_sbits / 8 + 1);
+	if (dbloom == NULL || sbloom == NULL) {
+		fatal("Out of memory");
+	}
+	if (pread(fd, dbloom, idxhead.x_dbits / 8, idxhead.x_dbloom)
+					!= (ssize_t) (idxhead.x_dbits / 8)
+	  || pread(fd, sbloom, idxhead.x_sbits / 8, idxhead.x_sbloom)
+					!= (ssize_t) (idxhead.x_sbits / 8)) {
+		error(1, "cannot read index %s", name);
+		(void) close(fd);
+		idxhead.x_count = 0;
+		return;
+	}
+
+	idxmaplen = stbuf.st_size;
+	idxmap = mmap(NULL, idxmaplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (idxmap == MAP_FAILED) {
+		error(1, "cannot map index %s", name);
+		idxmap = NULL;
+		idxhead.x_count = 0;
+		return;
+	}
+	idxents = (Idxent *) (idxmap + idxhead.x_entries);
+	idxattrs = (Idxattr *) (idxmap + idxhead.x_attrs);
+	idxidents = (uint32_t *) (idxmap + idxhead.x_idents);
+	idxblocks = (uint64_t *) (idxmap + idxhead.x_blocks);
+	idxroots = (Idxroot *) (idxmap + idxhead.x_roots);
+}
+
+/*
+ * With -G, if the directory is on btrfs, note the generation of its
+ * subvolume for the next run; and if the index has its generation as
+ * of the last run, enter just the files changed since then.
+ * Returns 1 if that was done and the directory needn't be walked.
+ */
+static int
+incremental(dirname)
+char *dirname;
+{
+	int fd;
+	struct statfs sfs;
+	struct stat stbuf;
+	Idxroot root, *rp = NULL;
+	struct btrfs_ioctl_ino_lookup_args lookup;
+	char *abs;
+	char **holes = NULL;		/* subtrees the search won't see */
+	int nholes = 0;
+	size_t wlen;
+	register uint64_t i;
+	register int h;
+	int rv;
+
+	if (!generations) {
+		return(0);
+	}
+
+	fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		return(0);
+	}
+	if (fstatfs(fd, &sfs) == -1 || sfs.f_type != BTRFS_SUPER_MAGIC
+	  || xfstat(fd, &stbuf) == -1 || btrfsroot(fd, &root) == -1
+	  || (abs = realpath(dirname, NULL)) == NULL) {
+		(void) close(fd);
+		return(0);
+	}
+
+	newroots = (Idxroot *) realloc(newroots,
+					(nnewroots + 1) * sizeof(Idxroot));
+	newrootnames = (char **) realloc(newrootnames,
+					(nnewroots + 1) * sizeof(char *));
+	if (newroots == NULL || newrootnames == NULL) {
+		fatal("Out of memory");
+	}
+	newroots[nnewroots] = root;
+	newrootnames[nnewroots++] = abs;
+
+	for (i = 0; idxmap != NULL && i < idxhead.x_nroots; i++) {
+		if (idxroots[i].r_name < idxhead.x_rootnamelen
+		  && strncmp(idxmap + idxhead.x_rootnames + idxroots[i].r_name,
+			     abs, idxhead.x_rootnamelen - idxroots[i].r_name) == 0
+		  && idxroots[i].r_subvol == root.r_subvol
+		  && memcmp(idxroots[i].r_fsid, root.r_fsid,
+						BTRFS_FSID_SIZE) == 0) {
+			rp = &idxroots[i];
+			break;
+		}
+	}
+	if (rp == NULL) {
+		(void) close(fd);
+		return(0);
+	}
+
+	/*
+	 * Find where the directory is in its subvolume, since the names
+	 * we will get for the changed files are relative to the top.
+	 */
+	(void) memset(&lookup, 0, sizeof(lookup));
+	lookup.treeid = root.r_subvol;
+	lookup.objectid = stbuf.st_ino;
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) == -1) {
+		(void) close(fd);
+		return(0);
+	}
+
+	/*
+	 * With -r, the subvolumes and mounts below the directory are
+	 * walked as usual, and what the search finds in them ignored.
+	 */
+	if (recursive) {
+		nholes = subtrees(fd, abs, lookup.name, root.r_subvol, &holes);
+		if (nholes == -1) {
+			(void) close(fd);
+			return(0);
+		}
+	}
+
+	rv = changed(fd, dirname, abs, lookup.name, rp->r_gen, holes);
+	(void) close(fd);
+	wlen = strlen(lookup.name);
+	for (h = 0; h < nholes; h++) {
+		if (rv == 0) {
+			walkroot(mkpath(dirname, holes[h] + wlen));
+			descend(mkpath(dirname, holes[h] + wlen));
+		}
+		free(holes[h]);
+	}
+	free(holes);
+	if (rv == 0) {
+		stats.s_incremental++;
+		return(1);
+	}
+	return(0);
+}
+
+/*
+ * Find the subvolumes nested in subvolume "subvol" and the mount
+ * points that are under the directory whose name in it is "where" (see
+ * changed()) and abs in full, leaving out those under another.  Their
+ * names in the subvolume are put in a NULL-terminated array in *holesp,
+ * and their number returned, or -1 if they can't all be found.
+ */
+static int
+subtrees(fd, abs, where, subvol, holesp)
+int fd;
+char *abs, *where;
+uint64_t subvol;
+char ***holesp;
+{
+	struct btrfs_ioctl_search_args search;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_root_ref ref;
+	struct btrfs_ioctl_ino_lookup_args lookup;
+	char **holes = NULL;
+	int nholes = 0;
+	size_t wlen = strlen(where), len;
+	char name[BTRFS_INO_LOOKUP_PATH_MAX + NAME_MAX + 1];
+	register unsigned long off;
+	register uint32_t i;
+	register int h, j, k;
+
+	addsubtree(&holes, &nholes, NULL, NULL);
+
+	/*
+	 * Each subvolume nested in this one has a reference to it, keyed
+	 * by the two, holding the directory it is in and its name there.
+	 */
+	(void) memset(&search, 0, sizeof(search));
+	search.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	search.key.min_objectid = search.key.max_objectid = subvol;
+	search.key.min_type = search.key.max_type = BTRFS_ROOT_REF_KEY;
+	search.key.max_offset = (uint64_t) -1;
+	search.key.max_transid = (uint64_t) -1;
+	for (;;) {
+		search.key.nr_items = 4096;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &search) == -1) {
+			goto fail;
+		}
+		if (search.key.nr_items == 0) {
+			break;
+		}
+		off = 0;
+		for (i = 0; i < search.key.nr_items; i++) {
+			(void) memcpy(&sh, search.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type != BTRFS_ROOT_REF_KEY
+			  || sh.len < sizeof(ref)) {
+				off += sh.len;
+				continue;
+			}
+			(void) memcpy(&ref, search.buf + off, sizeof(ref));
+			len = le16toh(ref.name_len);
+			if (len > sh.len - sizeof(ref) || len > NAME_MAX) {
+				goto fail;
+			}
+			(void) memset(&lookup, 0, sizeof(lookup));
+			lookup.treeid = subvol;
+			lookup.objectid = le64toh(ref.dirid);
+			if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) == -1) {
+				goto fail;
+			}
+			(void) snprintf(name, sizeof(name), "%s%.*s",
+				lookup.name, (int) len,
+				search.buf + off + sizeof(ref));
+			if (strncmp(name, where, wlen) == 0) {
+				addsubtree(&holes, &nholes, name, NULL);
+			}
+			off += sh.len;
+		}
+		if (sh.offset == (uint64_t) -1) {
+			break;
+		}
+		search.key.min_offset = sh.offset + 1;
+	}
+
+	if (mountsunder(abs, where, &holes, &nholes) == -1) {
+		goto fail;
+	}
+
+	/*
+	 * Those under another are walked with it.
+	 */
+	for (h = k = 0; h < nholes; h++) {
+		for (j = 0; j < nholes; j++) {
+			len = strlen(holes[j]);
+			if (j != h && strncmp(holes[h], holes[j], len) == 0
+			  && (holes[h][len] == '/'
+			    || (holes[h][len] == '\0' && j < h))) {
+				break;
+			}
+		}
+		if (j < nholes) {
+			free(holes[h]);
+		} else {
+			holes[k++] = holes[h];
+		}
+	}
+	holes[k] = NULL;
+	*holesp = holes;
+	return(k);
+
+fail:
+	for (h = 0; h < nholes; h++) {
+		free(holes[h]);
+	}
+	free(holes);
+	return(-1);
+}
+
+/*
+ * Add the mount points under abs, named in the subvolume as
+ * "where" is, to the holes.  Returns -1 if the mounts can't be read.
+ */
+static int
+mountsunder(abs, where, holesp, nholesp)
+char *abs, *where;
+char ***holesp;
+int *nholesp;
+{
+	FILE *fp;
+	char line[2 * PATH_MAX], mp[PATH_MAX];
+	register char *p, *q;
+	register int f;
+	size_t len = strlen(abs);
+
+	if (len > 0 && abs[len - 1] == '/') {
+		len--;
+	}
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (fp == NULL) {
+		return(-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/*
+		 * The fifth field is the mount point, with spaces and the
+		 * like as octal escapes.
+		 */
+		p = line;
+		for (f = 0; f < 4 && p != NULL; f++) {
+			p = strchr(p, ' ');
+			if (p != NULL) {
+				p++;
+			}
+		}
+		if (p == NULL) {
+			continue;
+		}
+		for (q = mp; *p != ' ' && *p != '\n' && *p != '\0'
+		  && q < mp + sizeof(mp) - 1; q++) {
+			if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3'
+			  && p[2] >= '0' && p[2] <= '7'
+			  && p[3] >= '0' && p[3] <= '7') {
+				*q = (p[1] - '0') << 6 | (p[2] - '0') << 3
+							| (p[3] - '0');
+				p += 4;
+			} else {
+				*q = *p++;
+			}
+		}
+		*q = '\0';
+		if (strncmp(mp, abs, len) == 0 && mp[len] == '/'
+		  && mp[len + 1] != '\0') {
+			addsubtree(holesp, nholesp, where, mp + len + 1);
+		}
+	}
+	(void) fclose(fp);
+	return(0);
+}
+
+/*
+ * Add the name a followed by b (if not NULL) to the holes, keeping room
+ * for a NULL at the end; with a NULL, just make the array.
+ */
+static void
+addsubtree(holesp, nholesp, a, b)
+char ***holesp;
+int *nholesp;
+char *a, *b;
+{
+	char *name = NULL;
+
+	if (a != NULL) {
+		name = malloc(strlen(a) + (b != NULL ? strlen(b) : 0) + 1);
+		if (name == NULL) {
+			fatal("Out of memory");
+		}
+		(void) strcpy(name, a);
+		if (b != NULL) {
+			(void) strcat(name, b);
+		}
+	}
+	*holesp = (char **) realloc(*holesp,
+					(*nholesp + 2) * sizeof(char *));
+	if (*holesp == NULL) {
+		fatal("Out of memory");
+	}
+	if (name != NULL) {
+		(*holesp)[(*nholesp)++] = name;
+	}
+	(*holesp)[*nholesp] = NULL;
+}
+
+/*
+ * Find the subvolume and filesystem of the directory open on fd, and
+ * the subvolume's generation now.  Returns 0, or -1 if they can't be
+ * found (we need CAP_SYS_ADMIN to search the tree of tree roots).
+ */
+static int
+btrfsroot(fd, rp)
+int fd;
+Idxroot *rp;
+{
+	struct btrfs_ioctl_ino_lookup_args lookup;
+	struct btrfs_ioctl_fs_info_args info;
+	struct btrfs_ioctl_search_args search;
+	struct btrfs_ioctl_search_header sh;
+	uint64_t gen;
+
+	(void) memset(rp, 0, sizeof(*rp));
+
+	(void) memset(&lookup, 0, sizeof(lookup));
+	lookup.treeid = 0;
+	lookup.objectid = BTRFS_FIRST_FREE_OBJECTID;
+	(void) memset(&info, 0, sizeof(info));
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) == -1
+	  || ioctl(fd, BTRFS_IOC_FS_INFO, &info) == -1) {
+		return(-1);
+	}
+	rp->r_subvol = lookup.treeid;
+	(void) memcpy(rp->r_fsid, info.fsid, BTRFS_FSID_SIZE);
+
+	(void) memset(&search, 0, sizeof(search));
+	search.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	search.key.min_objectid = search.key.max_objectid = rp->r_subvol;
+	search.key.min_type = search.key.max_type = BTRFS_ROOT_ITEM_KEY;
+	search.key.max_offset = (uint64_t) -1;
+	search.key.max_transid = (uint64_t) -1;
+	search.key.nr_items = 1;
+	if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &search) == -1
+	  || search.key.nr_items < 1) {
+		return(-1);
+	}
+	(void) memcpy(&sh, search.buf, sizeof(sh));
+	if (sh.type != BTRFS_ROOT_ITEM_KEY || sh.len < offsetof(
+			struct btrfs_root_item, generation) + sizeof(gen)) {
+		return(-1);
+	}
+	(void) memcpy(&gen, search.buf + sizeof(sh)
+		      + offsetof(struct btrfs_root_item, generation), sizeof(gen));
+	rp->r_gen = le64toh(gen);
+
+	return(0);
+}
+
+/*
+ * Enter the regular files in the subvolume of the directory open on fd
+ * whose inodes have changed since generation "gen", and are under the
+ * directory, whose name is dirname (abs in full) and whose name in the
+ * subvolume is "where" (empty, or ending in a slash).
+ * Returns 0, or -1 if the subvolume couldn't be searched.
+ */
+static int
+changed(fd, dirname, abs, where, gen, holes)
+int fd;
+char *dirname, *abs, *where;
+uint64_t gen;
+char **holes;
+{
+	struct btrfs_ioctl_search_args search;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_inode_item inode;
+	register unsigned long off;
+	register uint32_t i;
+
+	(void) memset(&search, 0, sizeof(search));
+	search.key.tree_id = 0;			/* fd's own subvolume */
+	search.key.min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+	search.key.max_objectid = (uint64_t) -1;
+	search.key.min_type = search.key.max_type = BTRFS_INODE_ITEM_KEY;
+	search.key.max_offset = (uint64_t) -1;
+	search.key.min_transid = gen + 1;
+	search.key.max_transid = (uint64_t) -1;
+
+	for (;;) {
+		search.key.nr_items = 4096;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &search) == -1) {
+			error(1, "cannot search btrfs tree under %s", abs);
+			return(-1);
+		}
+		if (search.key.nr_items == 0) {
+			return(0);
+		}
+
+		off = 0;
+		for (i = 0; i < search.key.nr_items; i++) {
+			(void) memcpy(&sh, search.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type == BTRFS_INODE_ITEM_KEY
+			  && sh.len >= sizeof(inode)) {
+				(void) memcpy(&inode, search.buf + off,
+								sizeof(inode));
+				if (le64toh(inode.transid) > gen
+				  && S_ISREG(le32toh(inode.mode))) {
+					(void) inodepaths(fd, sh.objectid,
+							dirname, where, holes);
+				}
+			}
+			off += sh.len;
+		}
+
+		/*
+		 * Carry on from just after the last key.
+		 */
+		search.key.min_objectid = sh.objectid;
+		search.key.min_type = sh.type;
+		search.key.min_offset = sh.offset;
+		if (search.key.min_offset < (uint64_t) -1) {
+			search.key.min_offset++;
+		} else if (search.key.min_objectid < (uint64_t) -1) {
+			search.key.min_objectid++;
+			search.key.min_offset = 0;
+			search.key.min_type = 0;
+		} else {
+			return(0);
+		}
+	}
+}
+
+/*
+ * Enter each name of inode "ino" in the subvolume of fd that is under
+ * the directory "where" in it (see changed()), and not under one of
+ * the holes, which are walked instead.
+ */
+static int
+inodepaths(fd, ino, dirname, where, holes)
+int fd;
+uint64_t ino;
+char *dirname, *where;
+char **holes;
+{
+	static struct btrfs_data_container *paths = NULL;
+	struct btrfs_ioctl_ino_path_args args;
+	size_t wlen = strlen(where);
+	char *name;
+	register uint32_t i;
+	register char **hp;
+	size_t hlen;
+
+	if (paths == NULL) {
+		paths = malloc(PATHBUFSIZE);
+		if (paths == NULL) {
+			fatal("Out of memory");
+		}
+	}
+	(void) memset(&args, 0, sizeof(args));
+	args.inum = ino;
+	args.size = PATHBUFSIZE;
+	args.fspath = (uintptr_t) paths;
+	if (ioctl(fd, BTRFS_IOC_INO_PATHS, &args) == -1) {
+		return(-1);
+	}
+
+	for (i = 0; i < paths->elem_cnt; i++) {
+		name = (char *) paths->val + paths->val[i];
+		if (strncmp(name, where, wlen) != 0) {
+			continue;		/* not under the directory */
+		}
+		for (hp = holes; hp != NULL && *hp != NULL; hp++) {
+			hlen = strlen(*hp);
+			if (strncmp(name, *hp, hlen) == 0 && name[hlen] == '/') {
+				break;
+			}
+		}
+		if (hp != NULL && *hp != NULL) {
+			continue;		/* walked instead */
+		}
+		name += wlen;
+		if (!recursive && strchr(name, '/') != NULL) {
+			continue;
+		}
+		stats.s_changed++;
+		if ((name = strdup(name)) == NULL) {
+			fatal("Out of memory");
+		}
+		(void) enter(name, dirname);
+	}
+	return(0);
+}
+
+/*
+ * Return the attributes of an index entry, or NULL if the index is
+ * damaged.
+ */
+static Idxattr *
+idxattr(ep)
+Idxent *ep;
+{
+	if (ep->e_attr >= idxhead.x_nattrs) {
+		return(NULL);
+	}
+	return(&idxattrs[ep->e_attr]);
+}
+
+/*
+ * A file time as nanoseconds since the epoch, as the index keeps it.
+ */
+static int64_t
+nstime(tp)
+struct timespec *tp;
+{
+	return((int64_t) tp->tv_sec * 1000000000 + tp->tv_nsec);
+}
+
+/*
+ * Return the name numbered n in the index, decoded into a static
+ * buffer, or NULL if the index is damaged.
+ */
+static char *
+idxpath(n)
+uint64_t n;
+{
+	static char name[PATH_MAX];
+	unsigned char *p, *end;
+	uint64_t prefix, len;
+	register uint64_t i;
+
+	if (n >= idxhead.x_count || idxblocks[n / NAMEBLOCK] >= idxhead.x_pathlen) {
+		return(NULL);
+	}
+	p = (unsigned char *) idxmap + idxhead.x_paths + idxblocks[n / NAMEBLOCK];
+	end = (unsigned char *) idxmap + idxhead.x_paths + idxhead.x_pathlen;
+
+	for (i = 0; i <= n % NAMEBLOCK; i++) {
+		prefix = 0;
+		if (i > 0 && !getvar(&p, end, &prefix)) {
+			return(NULL);
+		}
+		if (!getvar(&p, end, &len) || prefix + len >= sizeof(name)
+		  || len > (uint64_t) (end - p)) {
+			return(NULL);
+		}
+		(void) memcpy(name + prefix, p, len);
+		name[prefix + len] = '\0';
+		p += len;
+	}
+	return(name);
+}
+
+/*
+ * Store v at p as a variable-length integer, returning its length.
+ */
+static int
+putvar(p, v)
+unsigned char *p;
+uint64_t v;
+{
+	register int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return(n);
+}
+
+/*
+ * Fetch a variable-length integer from *pp, which mustn't run past end,
+ * and advance *pp over it.  Returns 0 if it does run past.
+ */
+static int
+getvar(pp, end, vp)
+unsigned char **pp, *end;
+uint64_t *vp;
+{
+	register unsigned char *p = *pp;
+	uint64_t v = 0;
+	register int shift = 0;
+
+	do {
+		if (p >= end || shift > 63) {
+			return(0);
+		}
+		v |= (uint64_t) (*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	*pp = p;
+	*vp = v;
+	return(1);
+}
+
+/*
+ * Hash every file in a class, and look each one up in the index;
+ * any file in the index with the same contents, that is still as it
+ * was and would be put in this class, is added to it.
+ * The files are hashed even if the size filter rules the class out,
+ * since the new index needs their digests: a later run can only find
+ * a file in the index by its digest.
+ */
+static void
+indexclass(hp)
+Head *hp;
+{
+	register Info *ip, *np;
+	Info *added = NULL;		/* files from the index */
+	Idxent *ep, *end;
+	Idxattr *ap;
+	size_t i;
+	int sizeok;			/* might the index have the size? */
+
+	digestall(hp, 1);
+
+	if (idxhead.x_count == 0) {
+		return;
+	}
+
+	sizeok = bloomtest(sbloom, idxhead.x_sbits,
+			   sizekey(hp->h_size), hp->h_size);
+	for (ip = hp->h_info; ip != NULL; ip = ip->i_next) {
+		if (!ip->i_hashed) {
+			continue;
+		}
+		stats.s_idxlookups++;
+		if (!sizeok) {
+			stats.s_idxsizeneg++;
+			continue;
+		}
+		if (!bloomtest(dbloom, idxhead.x_dbits,
+			       get64(ip->i_digest), get64(ip->i_digest + 8))) {
+			stats.s_idxdigestneg++;
+			continue;
+		}
+
+		stats.s_idxsearches++;
+		i = idxfind(ip->i_digest);
+		end = idxents + idxhead.x_count;
+		for (ep = idxents + i; ep < end
+		  && memcmp(ep->e_digest, ip->i_digest, SHA256_LEN) == 0; ep++) {
+			if (ep->e_size != (uint64_t) hp->h_size
+			  || (ap = idxattr(ep)) == NULL
+			  || ap->a_dev != (uint64_t) hp->h_dev) {
+				continue;
+			}
+
+			/*
+			 * Skip it if we have it already.
+			 */
+			for (np = hp->h_info; np != NULL; np = np->i_next) {
+				if (np->i_ino == ep->e_ino) {
+					break;
+				}
+			}
+			if (np == NULL) {
+				for (np = added; np != NULL; np = np->i_next) {
+					if (np->i_ino == ep->e_ino) {
+						break;
+					}
+				}
+			}
+			if (np != NULL) {
+				continue;
+			}
+
+			np = idxinfo(ep, hp);
+			if (np != NULL) {
+				np->i_next = added;
+				added = np;
+				stats.s_idxhits++;
+			}
+		}
+	}
+
+	/*
+	 * Put them at the end, so that files from this run are
+	 * compared first.
+	 */
+	if (added != NULL) {
+		for (ip = hp->h_info; ip->i_next != NULL; ip = ip->i_next) {
+			;
+		}
+		ip->i_next = added;
+	}
+}
+
+/*
+ * Make an Info for a file listed in the index, if it is still the file
+ * the index describes (its inode hasn't changed at all since, by its
+ * change time) and it belongs in the class hp.  Offline files are left
+ * alone, as they are by the walk.
+ */
+static Info *
+idxinfo(ep, hp)
+Idxent *ep;
+Head *hp;
+{
+	char *name = idxpath(ep->e_path);
+	struct stat stbuf;
+	uint64_t mnt;
+	uint64_t attrs;			/* statx attributes */
+	register Info *infop;
+
+	if (name == NULL) {
+		return(NULL);
+	}
+	if (xstat(name, AT_SYMLINK_NOFOLLOW, &stbuf, &mnt, &attrs) == -1
+	  || !S_ISREG(stbuf.st_mode)
+	  || stbuf.st_ino != ep->e_ino || stbuf.st_dev != hp->h_dev
+	  || stbuf.st_size != hp->h_size || mnt != hp->h_mnt
+	  || nstime(&stbuf.st_mtim) != ep->e_mtime
+	  || nstime(&stbuf.st_ctim) != ep->e_ctime
+	  || (!ignore_uid && stbuf.st_uid != hp->h_uid)
+	  || (!ignore_gid && stbuf.st_gid != hp->h_gid)
+	  || (!ignore_perms && (stbuf.st_mode & ALLPERMS) != hp->h_perms)
+	  || (!stubs && offline(name, &stbuf, attrs))) {
+		return(NULL);
+	}
+
+	infop = (Info *) calloc(1, sizeof(Info));
+	if (infop == NULL) {
+		fatal("Out of memory");
+	}
+	infop->i_name = strdup(name);
+	if (infop->i_name == NULL) {
+		fatal("Out of memory");
+	}
+	infop->i_ino = stbuf.st_ino;
+	infop->i_uid = stbuf.st_uid;
+	infop->i_nlink = stbuf.st_nlink;
+	infop->i_mtime = stbuf.st_mtim;
+	infop->i_ctime = stbuf.st_ctim;
+	(void) memcpy(infop->i_digest, ep->e_digest, SHA256_LEN);
+	infop->i_hashed = DIG_CACHED;
+	infop->i_indexed = 1;
+
+	return(infop);
+}
+
+/*
+ * Return the index of the first entry with the given digest, or of
+ * where it would be.
+ */
+static size_t
+idxfind(digest)
+unsigned char *digest;
+{
+	size_t lo = 0, hi = idxhead.x_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idxents[mid].e_digest, digest, SHA256_LEN) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+/*
+ * If the index has the digest of the given file, which is unchanged
+ * since it was last seen, fill it in and return 1.  The change time
+ * must have been earlier than when the walk that made the entry began,
+ * by STAMP_SLACK since file times may be taken from a coarser clock, or
+ * the file may have been written while it was being read (the entry is
+ * A_SETTLED); the size and times must be as they were.  Returns 0
+ * otherwise.
+ */
+static int
+idxknown(ip, hp)
+Info *ip;
+Head *hp;
+{
+	size_t lo = 0, hi = idxhead.x_count, mid;
+	register Idxent *ep;
+	Idxattr *ap;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idxidents[mid] >= idxhead.x_count
+		  || (ap = idxattr(&idxents[idxidents[mid]])) == NULL) {
+			return(0);		/* damaged */
+		}
+		ep = &idxents[idxidents[mid]];
+		if (ap->a_dev < (uint64_t) hp->h_dev
+		  || (ap->a_dev == (uint64_t) hp->h_dev
+		    && ep->e_ino < (uint64_t) ip->i_ino)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/*
+	 * There is one entry for each name of the inode.
+	 */
+	for (; lo < idxhead.x_count; lo++) {
+		if (idxidents[lo] >= idxhead.x_count) {
+			break;			/* damaged */
+		}
+		ep = &idxents[idxidents[lo]];
+		if ((ap = idxattr(ep)) == NULL
+		  || ap->a_dev != (uint64_t) hp->h_dev
+		  || ep->e_ino != (uint64_t) ip->i_ino) {
+			break;
+		}
+		if (ep->e_size == (uint64_t) hp->h_size
+		  && (ap->a_flags & A_SETTLED)
+		  && ep->e_mtime == nstime(&ip->i_mtime)
+		  && ep->e_ctime == nstime(&ip->i_ctime)) {
+			(void) memcpy(ip->i_digest, ep->e_digest, SHA256_LEN);
+			ip->i_hashed = DIG_CACHED;
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Bloom filters of "bits" bits: k bit positions are made from two
+ * 64-bit hashes h1 and h2 as h1 + i * h2.  Digests are their own hash;
+ * sizes are mixed first by sizekey().
+ */
+static int
+bloomtest(bloom, bits, h1, h2)
+unsigned char *bloom;
+uint64_t bits, h1, h2;
+{
+	uint64_t b;
+	register int i;
+
+	if (bits == 0) {
+		return(0);
+	}
+	for (i = 0; i < BLOOMK; i++) {
+		b = (h1 + i * h2) % bits;
+		if (!(bloom[b >> 3] & (1 << (b & 7)))) {
+			return(0);
+		}
+	}
+	return(1);
+}
+
+static void
+bloomset(bloom, bits, h1, h2)
+unsigned char *bloom;
+uint64_t bits, h1, h2;
+{
+	uint64_t b;
+	register int i;
+
+	for (i = 0; i < BLOOMK; i++) {
+		b = (h1 + i * h2) % bits;
+		bloom[b >> 3] |= 1 << (b & 7);
+	}
+}
+
+static uint64_t
+sizekey(size)
+uint64_t size;
+{
+	size ^= size >> 33;
+	size *= 0xff51afd7ed558ccdULL;
+	size ^= size >> 33;
+	return(size);
+}
+
+/*
+ * Write a new index, holding every file hashed on this run and every
+ * file in the old index that wasn't seen on this run, except those
+ * under the directories walked on this run, which must have gone.
+ * Other entries for files that have changed since are kept: they are
+ * checked when used.  A file that was linked to another, or had others
+ * linked to it, has a new change time, and perhaps a new inode, which
+ * are taken afresh.  The new index is written beside the old one and
+ * renamed over it.
+ */
+static void
+writeindex(name)
+char *name;
+{
+	Newent *v;			/* the entries */
+	size_t n, max, i, j;
+	register Head *hp;
+	register Info *ip;
+	char cwd[PATH_MAX];		/* to make names absolute */
+	char *tmpname;
+	Idxhead head;
+	unsigned char *db, *sb;		/* new filters */
+	unsigned char *names;		/* coded names */
+	uint64_t *blocks;		/* where each block of them starts */
+	size_t pathlen, namemax, len, prefix;
+	char *prev, *path;
+	Idxroot *roots;			/* -G directories */
+	char **rootnames;		/* and their names */
+	size_t nroots;
+	uint32_t *idents;		/* entries by inode */
+	Idxattr *attrs;			/* the attributes they share */
+	uint32_t *ahash;		/* them by attrslot(), numbered from 1 */
+	size_t nattrs, amax, hsize, h;
+	struct stat stbuf;
+	uint64_t mnt;			/* for xstat() */
+	char **walked;			/* directories walked, absolute */
+	FILE *fp;
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		error(1, "cannot find current directory; index not written");
+		return;
+	}
+
+	max = idxhead.x_count + 1024;
+	v = (Newent *) malloc(max * sizeof(Newent));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	n = 0;
+
+	for (i = 0; i < nallfiles; i++) {
+		ip = allfiles[i].m_info;
+		hp = allfiles[i].m_head;
+		if (ip->i_hashed < DIG_CACHED || ip->i_indexed) {
+			continue;
+		}
+		if (n == max) {
+			max *= 2;
+			v = (Newent *) realloc(v, max * sizeof(Newent));
+			if (v == NULL) {
+				fatal("Out of memory");
+			}
+		}
+		if (ip->i_linked) {
+			if (xstat(ip->i_name, AT_SYMLINK_NOFOLLOW,
+				  &stbuf, &mnt, NULL) == -1
+			  || !S_ISREG(stbuf.st_mode)
+			  || stbuf.st_size != hp->h_size
+			  || stbuf.st_mtim.tv_sec != ip->i_mtime.tv_sec
+			  || stbuf.st_mtim.tv_nsec
+					!= ip->i_mtime.tv_nsec) {
+				continue;
+			}
+			ip->i_ino = stbuf.st_ino;
+			ip->i_ctime = stbuf.st_ctim;
+		}
+		(void) memset(&v[n], 0, sizeof(Newent));
+		(void) memcpy(v[n].n_ent.e_digest, ip->i_digest, SHA256_LEN);
+		v[n].n_ent.e_size = hp->h_size;
+		v[n].n_ent.e_ino = ip->i_ino;
+		v[n].n_ent.e_mtime = nstime(&ip->i_mtime);
+		v[n].n_ent.e_ctime = nstime(&ip->i_ctime);
+		v[n].n_attr.a_dev = hp->h_dev;
+		v[n].n_attr.a_uid = hp->h_uid;
+		v[n].n_attr.a_gid = hp->h_gid;
+		v[n].n_attr.a_perms = hp->h_perms;
+		if (ip->i_ctime.tv_sec + STAMP_SLACK < idxstart) {
+			v[n].n_attr.a_flags = A_SETTLED;
+		}
+		v[n].n_path = ip->i_name[0] == '/' ? ip->i_name
+					: mkpath(cwd, ip->i_name);
+		v[n].n_new = 1;
+		n++;
+	}
+
+	for (i = 0; i < idxhead.x_count; i++) {
+		if ((path = idxpath(idxents[i].e_path)) == NULL
+		  || idxattr(&idxents[i]) == NULL) {
+			error(0, "index %s is damaged", name);
+			continue;
+		}
+		if (n == max) {
+			max *= 2;
+			v = (Newent *) realloc(v, max * sizeof(Newent));
+			if (v == NULL) {
+				fatal("Out of memory");
+			}
+		}
+		v[n].n_ent = idxents[i];
+		v[n].n_attr = *idxattr(&idxents[i]);
+		v[n].n_path = strdup(path);
+		if (v[n].n_path == NULL) {
+			fatal("Out of memory");
+		}
+		v[n].n_new = 0;
+		n++;
+	}
+
+	/*
+	 * Where a name is in both, the one from this run wins; an old
+	 * name in a directory walked on this run that wasn't seen again
+	 * has gone.
+	 */
+	walked = (char **) malloc((nwalkroots + 1) * sizeof(char *));
+	if (walked == NULL) {
+		fatal("Out of memory");
+	}
+	for (i = 0; i < (size_t) nwalkroots; i++) {
+		walked[i] = strcmp(walkroots[i], ".") == 0 ? cwd
+							   : mkpath(cwd, walkroots[i]);
+		for (len = strlen(walked[i]); len > 1
+		  && walked[i][len - 1] == '/'; len--) {
+			walked[i][len - 1] = '\0';
+		}
+	}
+	qsort(v, n, sizeof(Newent), pathcmp);
+	for (i = j = 0; i < n; i++) {
+		if (j > 0 && strcmp(v[j - 1].n_path, v[i].n_path) == 0) {
+			continue;
+		}
+		if (!v[i].n_new && underwalked(v[i].n_path, walked)) {
+			continue;
+		}
+		v[j++] = v[i];
+	}
+	n = j;
+	if (n >= UINT32_MAX) {
+		error(0, "too many files for index %s; not written", name);
+		return;
+	}
+
+	/*
+	 * Gather the attributes, each once.
+	 */
+	amax = 64;
+	hsize = 2 * amax;
+	attrs = (Idxattr *) malloc(amax * sizeof(Idxattr));
+	ahash = (uint32_t *) calloc(hsize, sizeof(uint32_t));
+	if (attrs == NULL || ahash == NULL) {
+		fatal("Out of memory");
+	}
+	nattrs = 0;
+	for (i = 0; i < n; i++) {
+		h = attrslot(&v[i].n_attr, attrs, ahash, hsize);
+		if (ahash[h] == 0) {
+			if (nattrs == amax) {
+				amax *= 2;
+				hsize *= 2;
+				attrs = (Idxattr *) realloc(attrs,
+						amax * sizeof(Idxattr));
+				free(ahash);
+				ahash = (uint32_t *) calloc(hsize,
+							sizeof(uint32_t));
+				if (attrs == NULL || ahash == NULL) {
+					fatal("Out of memory");
+				}
+				for (j = 0; j < nattrs; j++) {
+					ahash[attrslot(&attrs[j], attrs, ahash,
+						       hsize)] = j + 1;
+				}
+				h = attrslot(&v[i].n_attr, attrs, ahash, hsize);
+			}
+			attrs[nattrs++] = v[i].n_attr;
+			ahash[h] = nattrs;
+		}
+		v[i].n_ent.e_attr = ahash[h] - 1;
+	}
+	free(ahash);
+
+	/*
+	 * The names are now in order: code them.
+	 */
+	blocks = (uint64_t *) malloc(((n + NAMEBLOCK - 1) / NAMEBLOCK + 1)
+							* sizeof(uint64_t));
+	namemax = 64 * 1024;
+	names = (unsigned char *) malloc(namemax);
+	if (blocks == NULL || names == NULL) {
+		fatal("Out of memory");
+	}
+	pathlen = 0;
+	prev = "";
+	for (i = 0; i < n; i++) {
+		len = strlen(v[i].n_path);
+		while (pathlen + len + 20 > namemax) {
+			namemax *= 2;
+			names = (unsigned char *) realloc(names, namemax);
+			if (names == NULL) {
+				fatal("Out of memory");
+			}
+		}
+		if (i % NAMEBLOCK == 0) {
+			blocks[i / NAMEBLOCK] = pathlen;
+			prefix = 0;
+		} else {
+			for (prefix = 0; prev[prefix] != '\0'
+			  && prev[prefix] == v[i].n_path[prefix]; prefix++) {
+				;
+			}
+			pathlen += putvar(names + pathlen, prefix);
+		}
+		pathlen += putvar(names + pathlen, len - prefix);
+		(void) memcpy(names + pathlen, v[i].n_path + prefix, len - prefix);
+		pathlen += len - prefix;
+		v[i].n_ent.e_path = i;
+		prev = v[i].n_path;
+	}
+
+	qsort(v, n, sizeof(Newent), entcmp);
+
+	idents = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+	if (idents == NULL) {
+		fatal("Out of memory");
+	}
+	for (i = 0; i < n; i++) {
+		idents[i] = i;
+	}
+	identv = v;
+	qsort(idents, n, sizeof(uint32_t), identcmp);
+
+	(void) memset(&head, 0, sizeof(head));
+	(void) memcpy(head.x_magic, INDEX_MAGIC, sizeof(head.x_magic));
+	head.x_version = INDEX_VERSION;
+	head.x_bloomk = BLOOMK;
+	head.x_count = n;
+	head.x_dbits = ((uint64_t) n * BLOOMBITS + 63) & ~(uint64_t) 63;
+	head.x_sbits = head.x_dbits;
+
+	db = calloc(head.x_dbits / 8 + 1, 1);
+	sb = calloc(head.x_sbits / 8 + 1, 1);
+	if (db == NULL || sb == NULL) {
+		fatal("Out of memory");
+	}
+	for (i = 0; i < n; i++) {
+		bloomset(db, head.x_dbits, get64(v[i].n_ent.e_digest),
+					   get64(v[i].n_ent.e_digest + 8));
+		bloomset(sb, head.x_sbits, sizekey(v[i].n_ent.e_size),
+					   v[i].n_ent.e_size);
+	}
+
+	head.x_dbloom = sizeof(head);
+	head.x_sbloom = head.x_dbloom + head.x_dbits / 8;
+	head.x_entries = head.x_sbloom + head.x_sbits / 8;
+	head.x_attrs = head.x_entries + n * sizeof(Idxent);
+	head.x_nattrs = nattrs;
+	head.x_blocks = head.x_attrs + nattrs * sizeof(Idxattr);
+	head.x_idents = head.x_blocks
+			+ (n + NAMEBLOCK - 1) / NAMEBLOCK * sizeof(uint64_t);
+	head.x_paths = head.x_idents + n * sizeof(uint32_t);
+	head.x_pathlen = pathlen;
+
+	/*
+	 * The -G directories: those seen on this run, and the rest of
+	 * the old ones.
+	 */
+	roots = (Idxroot *) malloc((nnewroots + idxhead.x_nroots + 1)
+							* sizeof(Idxroot));
+	rootnames = (char **) malloc((nnewroots + idxhead.x_nroots + 1)
+							* sizeof(char *));
+	if (roots == NULL || rootnames == NULL) {
+		fatal("Out of memory");
+	}
+	nroots = 0;
+	for (i = 0; i < (size_t) nnewroots; i++) {
+		roots[nroots] = newroots[i];
+		rootnames[nroots++] = newrootnames[i];
+	}
+	for (i = 0; idxmap != NULL && i < idxhead.x_nroots; i++) {
+		path = idxmap + idxhead.x_rootnames + idxroots[i].r_name;
+		if (idxroots[i].r_name >= idxhead.x_rootnamelen
+		  || memchr(path, '\0', idxhead.x_rootnamelen
+					- idxroots[i].r_name) == NULL) {
+			continue;
+		}
+		for (j = 0; j < (size_t) nnewroots; j++) {
+			if (strcmp(newrootnames[j], path) == 0) {
+				break;
+			}
+		}
+		if (j == (size_t) nnewroots) {
+			roots[nroots] = idxroots[i];
+			rootnames[nroots++] = path;
+		}
+	}
+	len = 0;
+	for (i = 0; i < nroots; i++) {
+		roots[i].r_name = len;
+		len += strlen(rootnames[i]) + 1;
+	}
+	head.x_roots = head.x_paths + pathlen;
+	head.x_nroots = nroots;
+	head.x_rootnames = head.x_roots + nroots * sizeof(Idxroot);
+	head.x_rootnamelen = len;
+
+	tmpname = malloc(strlen(name) + 5);
+	if (tmpname == NULL) {
+		fatal("Out of memory");
+	}
+	(void) sprintf(tmpname, "%s.new", name);
+	fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		error(1, "cannot create %s", tmpname);
+		return;
+	}
+	(void) fwrite(&head, sizeof(head), 1, fp);
+	(void) fwrite(db, head.x_dbits / 8, 1, fp);
+	(void) fwrite(sb, head.x_sbits / 8, 1, fp);
+	for (i = 0; i < n; i++) {
+		(void) fwrite(&v[i].n_ent, sizeof(Idxent), 1, fp);
+	}
+	(void) fwrite(attrs, sizeof(Idxattr), nattrs, fp);
+	(void) fwrite(blocks, sizeof(uint64_t), (n + NAMEBLOCK - 1) / NAMEBLOCK, fp);
+	(void) fwrite(idents, sizeof(uint32_t), n, fp);
+	(void) fwrite(names, 1, pathlen, fp);
+	(void) fwrite(roots, sizeof(Idxroot), nroots, fp);
+	for (i = 0; i < nroots; i++) {
+		(void) fwrite(rootnames[i], 1, strlen(rootnames[i]) + 1, fp);
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+		error(1, "cannot write %s", tmpname);
+		(void) fclose(fp);
+		(void) unlink(tmpname);
+		return;
+	}
+	(void) fclose(fp);
+	if (rename(tmpname, name) == -1) {
+		error(1, "cannot rename %s to %s", tmpname, name);
+		(void) unlink(tmpname);
+		return;
+	}
+	stats.s_idxwritten = n;
+
+	free(db);
+	free(sb);
+	free(names);
+	free(blocks);
+	free(roots);
+	free(rootnames);
+	free(idents);
+	free(attrs);
+	free(tmpname);
+	free(v);
+}
+
+/*
+ * Order new index entries by name, those from this run first.
+ */
+/*
+ * Is the named file in one of the directories walked on this run,
+ * whose absolute names are in walked?  Without -r, only the files
+ * directly in them are.
+ */
+static int
+underwalked(path, walked)
+char *path;
+char **walked;
+{
+	register int i;
+	size_t len;
+	char *rest;
+
+	for (i = 0; i < nwalkroots; i++) {
+		len = strlen(walked[i]);
+		if (strncmp(path, walked[i], len) != 0
+		  || (path[len] != '/' && walked[i][len - 1] != '/')) {
+			continue;
+		}
+		for (rest = path + len; *rest == '/'; rest++) {
+			;
+		}
+		if (recursive || strchr(rest, '/') == NULL) {
+			return(1);
+		}
+	}
+	return(0);
+}
+
+static int
+pathcmp(const void *a, const void *b)
+{
+	const Newent *na = (const Newent *) a;
+	const Newent *nb = (const Newent *) b;
+	int diff;
+
+	diff = strcmp(na->n_path, nb->n_path);
+	if (diff == 0) {
+		diff = nb->n_new - na->n_new;
+	}
+	return(diff);
+}
+
+/*
+ * Order new index entries by digest, then by name.
+ */
+static int
+entcmp(const void *a, const void *b)
+{
+	const Newent *na = (const Newent *) a;
+	const Newent *nb = (const Newent *) b;
+	int diff;
+
+	diff = memcmp(na->n_ent.e_digest, nb->n_ent.e_digest, SHA256_LEN);
+	if (diff == 0) {
+		diff = strcmp(na->n_path, nb->n_path);
+	}
+	return(diff);
+}
+
+/*
+ * Order the numbers of new index entries (in identv) by device and
+ * inode.
+ */
+static int
+identcmp(const void *a, const void *b)
+{
+	const Newent *na = &identv[*(const uint32_t *) a];
+	const Newent *nb = &identv[*(const uint32_t *) b];
+
+	if (na->n_attr.a_dev != nb->n_attr.a_dev) {
+		return(na->n_attr.a_dev < nb->n_attr.a_dev ? -1 : 1);
+	}
+	if (na->n_ent.e_ino != nb->n_ent.e_ino) {
+		return(na->n_ent.e_ino < nb->n_ent.e_ino ? -1 : 1);
+	}
+	return(0);
+}
+
+/*
+ * Return the slot in ahash, a table of hsize slots (a power of 2)
+ * numbering entries of attrs from 1, where the attributes *ap are, or
+ * the empty one where they would go.
+ */
+static size_t
+attrslot(ap, attrs, ahash, hsize)
+Idxattr *ap, *attrs;
+uint32_t *ahash;
+size_t hsize;
+{
+	uint64_t h;
+
+	h = ap->a_dev;
+	h = h * 0x9e3779b97f4a7c15ULL + ap->a_uid;
+	h = h * 0x9e3779b97f4a7c15ULL + ap->a_gid;
+	h = h * 0x9e3779b97f4a7c15ULL + ap->a_perms;
+	h = h * 0x9e3779b97f4a7c15ULL + ap->a_flags;
+	for (h = sizekey(h) & (hsize - 1); ahash[h] != 0
+	  && memcmp(&attrs[ahash[h] - 1], ap, sizeof(Idxattr)) != 0;
+	  h = (h + 1) & (hsize - 1)) {
+		;
+	}
+	return(h);
+}
+
+/*
+ * Given a file and the group of files found to be identical to it,
+ * choose which one to keep and queue the replacement of all the others
+ * by links to it.  A file that can't be replaced must be the one kept;
+ * otherwise the one with the most links is kept; on a tie, the earliest
+ * in the group wins.  If the one kept would get more links than its
+ * filesystem allows, another of the files yet to be replaced is chosen
+ * by the same rule to be kept instead (see nextkeeper()), and the rest
+ * are linked to that.
+ */
+static void
+plan(group, hp)
+Info *group;
+Head *hp;
+{
+	register Info *ip;
+	Info *keep = NULL;
+	Info *mostlinks = NULL;		/* who -K links would have kept */
+	nlink_t keeplinks = 0;
+	long links;
+	long keepextents = LONG_MAX, ext = 0;
+	struct stat stbuf;
+	uint64_t mnt;			/* for xstat() */
+	Fsinfo *fp;
+
+	if (group->i_same == NULL) {
+		return;
+	}
+
+	for (ip = group; ip != NULL; ip = ip->i_same) {
+		if (xstat(ip->i_name, AT_SYMLINK_NOFOLLOW, &stbuf, &mnt,
+							NULL) == -1) {
+			patherror(ip->i_name, "cannot restat %s", ip->i_name);
+			ip->i_ino = 0;		/* leave it alone */
+			continue;
+		}
+		if (stbuf.st_ino != ip->i_ino || stbuf.st_size != hp->h_size
+		  || stbuf.st_mtim.tv_sec != ip->i_mtime.tv_sec
+		  || stbuf.st_mtim.tv_nsec != ip->i_mtime.tv_nsec) {
+			ip->i_ino = 0;		/* changed since the walk */
+			continue;
+		}
+		ip->i_nlink = stbuf.st_nlink;
+		ip->i_ctime = stbuf.st_ctim;	/* -x may have set it */
+		if (mostlinks == NULL || (ip->i_fixed && !mostlinks->i_fixed)
+		  || (ip->i_fixed == mostlinks->i_fixed
+		    && stbuf.st_nlink > mostlinks->i_nlink)) {
+			mostlinks = ip;
+		}
+		if (keeper == KEEP_EXTENTS && !(keep != NULL && keep->i_fixed
+							&& !ip->i_fixed)) {
+			ext = extents(ip->i_name);
+		}
+		if (keep == NULL || (ip->i_fixed && !keep->i_fixed)
+		  || (ip->i_fixed == keep->i_fixed
+		    && (keeper == KEEP_EXTENTS && ext != keepextents
+			? ext < keepextents : stbuf.st_nlink > keeplinks))) {
+			keep = ip;
+			keeplinks = stbuf.st_nlink;
+			keepextents = ext;
+		}
+	}
+
+	if (keep == NULL) {
+		return;
+	}
+	if (keep != mostlinks && keep->i_ino != mostlinks->i_ino) {
+		stats.s_defrag++;
+	}
+	fp = getfs(hp->h_dev, keep->i_name);
+	links = keeplinks;
+
+	/*
+	 * Replacing a file only frees its space if this is its last name.
+	 */
+	for (ip = group; ip != NULL; ip = ip->i_same) {
+		if (ip == keep || ip->i_ino == 0 || ip->i_ino == keep->i_ino
+		  || ip->i_fixed) {
+			continue;
+		}
+		if (links >= fp->f_linkmax) {
+			keep = nextkeeper(ip, keep);
+			links = keep->i_nlink;
+			if (ip->i_ino == keep->i_ino) {
+				continue;
+			}
+		}
+		keep->i_linked = ip->i_linked = 1;
+		queue(keep, ip, hp, ip->i_trusted > keep->i_trusted
+						? ip->i_trusted : keep->i_trusted);
+		links++;
+	}
+}
+
+/*
+ * The file kept, full, can take no more links.  Choose the one to keep
+ * instead from the files still to be replaced, ip and those after it,
+ * by the rule plan() uses: with -K extents the fewest extents, then
+ * the most links; on a tie, the earliest.
+ */
+static Info *
+nextkeeper(ip, full)
+Info *ip;
+Info *full;
+{
+	Info *best = NULL;
+	long ext = 0, bestext = LONG_MAX;
+
+	for (; ip != NULL; ip = ip->i_same) {
+		if (ip->i_ino == 0 || ip->i_ino == full->i_ino || ip->i_fixed) {
+			continue;
+		}
+		if (keeper == KEEP_EXTENTS) {
+			ext = extents(ip->i_name);
+		}
+		if (best == NULL
+		  || (keeper == KEEP_EXTENTS && ext != bestext
+			? ext < bestext : ip->i_nlink > best->i_nlink)) {
+			best = ip;
+			bestext = ext;
+		}
+	}
+	return(best);
+}
+
+/*
+ * Return the number of extents the named file's data is in, or
+ * LONG_MAX if the filesystem can't say.
+ */
+static long
+extents(name)
+char *name;
+{
+	struct fiemap fm;
+	int fd;
+
+	fd = timedopen(name);
+	if (fd == -1) {
+		return(LONG_MAX);
+	}
+	(void) memset(&fm, 0, sizeof(fm));
+	fm.fm_start = 0;
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_extent_count = 0;		/* just count them */
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1) {
+		(void) close(fd);
+		return(LONG_MAX);
+	}
+	(void) close(fd);
+	return(fm.fm_mapped_extents);
+}
+
+/*
+ * Add the replacement of file "ip" by a link to "keep", both in class
+ * hp, to the queue.  "trusted" says whether the two were found
+ * identical on their digests alone.
+ */
+static void
+queue(keep, ip, hp, trusted)
+Info *keep, *ip;
+Head *hp;
+int trusted;
+{
+	register Op *op;
+	register char *cp;
+	char *to = ip->i_name;
+
+	if (nops == maxops) {
+		maxops = maxops ? maxops * 2 : 1024;
+		ops = (Op *) realloc(ops, maxops * sizeof(Op));
+		if (ops == NULL) {
+			fatal("Out of memory");
+		}
+	}
+	op = &ops[nops++];
+
+	op->o_from = keep->i_name;
+	op->o_to = to;
+	op->o_size = ip->i_nlink == 1 ? hp->h_size : 0;
+	op->o_length = hp->h_size;
+	op->o_keep = keep;
+	op->o_file = ip;
+	op->o_trusted = trusted;
+
+	/*
+	 * Split "to" into its directory and its last component.
+	 */
+	cp = strrchr(to, '/');
+	if (cp == NULL) {
+		op->o_dir = dot;
+		op->o_base = to;
+	} else {
+		op->o_base = cp + 1;
+		if (cp == to) {
+			op->o_dir = "/";
+		} else {
+			op->o_dir = malloc((unsigned) (cp - to + 1));
+			if (op->o_dir == NULL) {
+				fatal("Out of memory");
+			}
+			(void) memcpy(op->o_dir, to, cp - to);
+			op->o_dir[cp - to] = '\0';
+		}
+	}
+}
+
+/*
+ * Order queued operations by directory, then by name within it.
+ */
+static int
+opcmp(const void *a, const void *b)
+{
+	const Op *oa = (const Op *) a;
+	const Op *ob = (const Op *) b;
+	int diff;
+
+	diff = strcmp(oa->o_dir, ob->o_dir);
+	if (diff == 0) {
+		diff = strcmp(oa->o_base, ob->o_base);
+	}
+	return(diff);
+}
+
+/*
+ * Perform all the queued replacements, grouped by the directory
+ * of the file being replaced so that each directory is opened once
+ * and its entries are all updated together.
+ * Then make them durable as requested by -D.
+ */
+static void
+linkall()
+{
+	register size_t first, last;	/* bounds of a directory's batch */
+	int dirfd;			/* the directory of the batch */
+	int done;			/* links made in this batch */
+	double start;			/* when we began */
+
+	start = now();
+	(void) clock_gettime(CLOCK_REALTIME_COARSE, &linkstart);
+
+	if (debug) {
+		(void) printf("linkall(%lu)\n", (unsigned long) nops);
+	}
+
+	qsort(ops, nops, sizeof(Op), opcmp);
+
+	for (first = 0; first < nops; first = last) {
+		for (last = first + 1; last < nops; last++) {
+			if (strcmp(ops[last].o_dir, ops[first].o_dir) != 0) {
+				break;
+			}
+		}
+
+		dirfd = -1;
+		if (!noexec) {
+			dirfd = open(ops[first].o_dir, O_RDONLY | O_DIRECTORY);
+			if (dirfd == -1) {
+				patherror(ops[first].o_dir,
+					"cannot open directory %s; %lu files in it not linked",
+					ops[first].o_dir,
+					(unsigned long) (last - first));
+				stats.s_failed += last - first;
+				continue;
+			}
+		}
+
+		stats.s_dirs++;
+		done = 0;
+		for (; first < last; first++) {
+			if (replace2(&ops[first], dirfd) == 1) {
+				stats.s_links++;
+				stats.s_saved += ops[first].o_size;
+				if (wheredepth > 0) {
+					attribute(ops[first].o_to, 0, 0,
+							ops[first].o_size);
+				}
+				if (ops[first].o_trusted == BY_DIGEST) {
+					stats.s_trusted++;
+				} else if (ops[first].o_trusted == BY_VERITY) {
+					stats.s_verity++;
+				}
+				done++;
+			} else {
+				stats.s_failed++;
+			}
+		}
+
+		if (dirfd != -1) {
+			if (done > 0) {
+				syncdir(dirfd);
+			} else {
+				(void) close(dirfd);
+			}
+		}
+	}
+
+	syncall();
+
+	stats.s_linktime = now() - start;
+}
+
+/*
+ * We have finished linking into the directory open on dirfd.
+ * Sync it if -D dir was given; if -D fs, keep it open to be
+ * synced at the end if it is on a filesystem we haven't seen yet.
+ */
+static void
+syncdir(dirfd)
+int dirfd;
+{
+	struct stat stbuf;
+	double start;
+	register int i;
+
+	switch (durability) {
+	case SYNC_DIR:
+		start = now();
+		if (fsync(dirfd) == -1) {
+			error(1, "cannot fsync directory");
+		}
+		stats.s_syncs++;
+		stats.s_synctime += now() - start;
+		break;
+
+	case SYNC_FS:
+		if (xfstat(dirfd, &stbuf) == -1) {
+			break;
+		}
+		for (i = 0; i < nfs; i++) {
+			if (fsdevs[i] == stbuf.st_dev) {
+				break;
+			}
+		}
+		if (i < nfs) {
+			break;
+		}
+		fsfds = (int *) realloc(fsfds, (nfs + 1) * sizeof(int));
+		fsdevs = (dev_t *) realloc(fsdevs, (nfs + 1) * sizeof(dev_t));
+		if (fsfds == NULL || fsdevs == NULL) {
+			fatal("Out of memory");
+		}
+		fsfds[nfs] = dirfd;
+		fsdevs[nfs] = stbuf.st_dev;
+		nfs++;
+		return;			/* leave it open */
+	}
+
+	(void) close(dirfd);
+}
+
+/*
+ * For -D fs, sync every filesystem we have linked into, once.
+ */
+static void
+syncall()
+{
+	double start;
+	register int i;
+
+	for (i = 0; i < nfs; i++) {
+		start = now();
+		if (syncfs(fsfds[i]) == -1) {
+			error(1, "cannot sync filesystem");
+		}
+		stats.s_syncs++;
+		stats.s_synctime += now() - start;
+		(void) close(fsfds[i]);
+	}
+	nfs = 0;
+}
+
+/*
+ * Print the statistics gathered during the run.
+ */
+static void
+report()
+{
+	register int op;
+
+	(void) printf("%lu files in %lu classes; %lu offline files left alone\n",
+				stats.s_files, stats.s_classes, stats.s_offline);
+	(void) printf("%lu directories skipped as seen through another mount, %lu as loops\n",
+				stats.s_remounts, stats.s_loops);
+	(void) printf("%lu files could never be linked, %lu could only be kept\n",
+				stats.s_unlinkable, stats.s_fixed);
+	(void) printf("%lu compares, %lld bytes read\n",
+				stats.s_compares, (long long) stats.s_bytesread);
+	if (crcmode != CRC_NONE) {
+		(void) printf("%lu files fingerprinted with crc32c (%s) over %s, %lld bytes read; %lu found unique\n",
+					stats.s_crcs, crc32cimpl(), crcnames[crcmode],
+					(long long) stats.s_crcbytes, stats.s_crcunique);
+	}
+	if (trusthash) {
+		(void) printf("%lu links made on %s digests alone\n",
+					stats.s_trusted, algnames[ALG_SHA256]);
+	}
+	if (stats.s_veritied > 0) {
+		(void) printf("%lu fs-verity digests fetched; %lu links made on them\n",
+					stats.s_veritied, stats.s_verity);
+	}
+	if (hashcache || trusthash) {
+		(void) printf("%lu files hashed, %lld bytes read; %lu hashed while comparing; %lu digests cached, %lu found in cache\n",
+					stats.s_hashed, (long long) stats.s_hashbytes,
+					stats.s_comparedigests,
+					stats.s_cachestored, stats.s_cachehits);
+	}
+	if (noexec) {
+		(void) printf("%lu files would be linked in %lu directories, %lld bytes would be freed\n",
+				stats.s_links, stats.s_dirs,
+				(long long) stats.s_saved);
+	} else {
+		(void) printf("%lu files linked in %lu directories, %lu failed (%lu changed since compared), %lld bytes freed\n",
+				stats.s_links, stats.s_dirs, stats.s_failed,
+				stats.s_rewritten, (long long) stats.s_saved);
+	}
+	if (indexfile != NULL) {
+		(void) printf("index: %lu digests known, %lu lookups, %lu stopped by size filter, %lu by digest filter, %lu searched, %lu files added; %lu entries written\n",
+					stats.s_idxknown, stats.s_idxlookups,
+					stats.s_idxsizeneg, stats.s_idxdigestneg,
+					stats.s_idxsearches, stats.s_idxhits,
+					stats.s_idxwritten);
+		if (generations) {
+			(void) printf("%lu directories not walked; %lu changed files found in them\n",
+					stats.s_incremental, stats.s_changed);
+		}
+	}
+	if (keeper == KEEP_EXTENTS) {
+		(void) printf("%lu files kept for being less fragmented than the one with most links\n",
+					stats.s_defrag);
+	}
+	for (op = 0; op < ntunes; op++) {
+		(void) printf("compare reads on device %u:%u capped at %lu KiB\n",
+				major(tunes[op].t_dev), minor(tunes[op].t_dev),
+				((unsigned long) RAMPMIN << tunes[op].t_cap) / 1024);
+	}
+	if (timeout > 0) {
+		(void) printf("%lu files quarantined after stalling for %us\n",
+					stats.s_quarantined, timeout);
+	}
+	(void) printf("link phase %.3fs; durability %s: %lu syncs, %.3fs\n",
+				stats.s_linktime, syncnames[durability],
+				stats.s_syncs, stats.s_synctime);
+	latmerge();
+	for (op = 0; op < NLAT; op++) {
+		if (alllat.l_total[op] == 0) {
+			continue;
+		}
+		(void) printf("%-8s %9llu calls, microseconds: p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+				latnames[op], (unsigned long long) alllat.l_total[op],
+				percentile(op, 0.5) / 1e3, percentile(op, 0.99) / 1e3,
+				percentile(op, 0.999) / 1e3, alllat.l_max[op] / 1e3);
+	}
+}
+
+/*
+ * Charge reading, a compare and space freed to the directory
+ * wheredepth levels down (or less, if it isn't that deep) holding
+ * the named file.
+ */
+static void
+attribute(name, nread, ncompares, nsaved)
+char *name;
+off_t nread;
+int ncompares;
+off_t nsaved;
+{
+	Where *old;
+	size_t oldmax, i, len;
+	char *last;
+	register Where *wp;
+	register int depth;
+	uint64_t h;
+
+	last = strrchr(name, '/');
+	if (last == NULL) {
+		name = ".";
+		len = 1;
+	} else if (last == name) {
+		len = 1;
+	} else {
+		len = last - name;
+		for (i = 1, depth = 0; i < len; i++) {
+			if (name[i] == '/' && name[i - 1] != '/'
+			  && ++depth == wheredepth) {
+				len = i;
+				break;
+			}
+		}
+	}
+
+	if (nwheres * 2 >= maxwheres) {
+		old = wheres;
+		oldmax = maxwheres;
+		maxwheres = maxwheres ? maxwheres * 2 : 256;
+		wheres = (Where *) calloc(maxwheres, sizeof(Where));
+		if (wheres == NULL) {
+			fatal("Out of memory");
+		}
+		nwheres = 0;
+		for (i = 0; i < oldmax; i++) {
+			if (old[i].w_prefix != NULL) {
+				h = prefixhash(old[i].w_prefix,
+						strlen(old[i].w_prefix));
+				for (h &= maxwheres - 1; wheres[h].w_prefix != NULL;
+						h = (h + 1) & (maxwheres - 1)) {
+					;
+				}
+				wheres[h] = old[i];
+				nwheres++;
+			}
+		}
+		free(old);
+	}
+
+	h = prefixhash(name, len);
+	for (h &= maxwheres - 1; ; h = (h + 1) & (maxwheres - 1)) {
+		wp = &wheres[h];
+		if (wp->w_prefix == NULL) {
+			wp->w_prefix = strndup(name, len);
+			if (wp->w_prefix == NULL) {
+				fatal("Out of memory");
+			}
+			nwheres++;
+			break;
+		}
+		if (strncmp(wp->w_prefix, name, len) == 0
+		  && wp->w_prefix[len] == '\0') {
+			break;
+		}
+	}
+
+	wp->w_read += nread;
+	wp->w_compares += ncompares;
+	wp->w_saved += nsaved;
+}
+
+/*
+ * Hash the first len bytes of a name (FNV-1a).
+ */
+static uint64_t
+prefixhash(name, len)
+char *name;
+size_t len;
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	register size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+	}
+	return(h);
+}
+
+/*
+ * Print the directories where most was read for least freed.
+ */
+static void
+wherereport()
+{
+	Where *v;
+	size_t n, i;
+	char ratio[32];
+
+	v = (Where *) malloc((nwheres + 1) * sizeof(Where));
+	if (v == NULL) {
+		fatal("Out of memory");
+	}
+	for (i = n = 0; i < maxwheres; i++) {
+		if (wheres[i].w_prefix != NULL && wheres[i].w_read > 0) {
+			v[n++] = wheres[i];
+		}
+	}
+	qsort(v, n, sizeof(Where), wherecmp);
+
+	(void) printf("%14s %14s %9s %9s  %s\n",
+			"bytes read", "bytes freed", "ratio", "compares", "under");
+	for (i = 0; i < n && i < WORSTN; i++) {
+		if (v[i].w_saved == 0) {
+			(void) strcpy(ratio, "-");
+		} else {
+			(void) sprintf(ratio, "%.1f",
+					(double) v[i].w_read / v[i].w_saved);
+		}
+		(void) printf("%14lld %14lld %9s %9lu  %s\n",
+				(long long) v[i].w_read, (long long) v[i].w_saved,
+				ratio, v[i].w_compares, v[i].w_prefix);
+	}
+	free(v);
+}
+
+/*
+ * Order prefixes worst first: those where nothing was freed, by bytes
+ * read, then the rest by the ratio of bytes read to bytes freed.
+ */
+static int
+wherecmp(const void *a, const void *b)
+{
+	const Where *wa = (const Where *) a;
+	const Where *wb = (const Where *) b;
+	double ra, rb;
+
+	if ((wa->w_saved == 0) != (wb->w_saved == 0)) {
+		return(wa->w_saved == 0 ? -1 : 1);
+	}
+	if (wa->w_saved == 0) {
+		return(wa->w_read > wb->w_read ? -1 : wa->w_read < wb->w_read);
+	}
+	ra = (double) wa->w_read / wa->w_saved;
+	rb = (double) wb->w_read / wb->w_saved;
+	return(ra > rb ? -1 : ra < rb);
+}
+
+/*
+ * This is the nasty bit; we musn't ever lose files here.
+ *
+ * Do the replacement op: replace the file o_base in the directory
+ * open on dirfd, whose full name is o_to, with a link to o_from,
+ * unless either has changed since plan() looked at them.
+ * o_trusted says they were only found identical by digest.
+ * Returns 0 for failure, 1 for success, -1 for catastrophic
+ * failure (i.e. one of the files may have been lost)
+ */
+static int
+replace2(op, dirfd)
+Op *op;
+int dirfd;
+{
+	char *from = op->o_from;
+	char *base = op->o_base;
+	char *to = op->o_to;
+	int trusted = op->o_trusted;
+	char newname[1024];		/* save file name */
+	char *newbase;			/* its last component */
+	time_t clock;			/* time for temp file name */
+	uint64_t start;			/* when each step started */
+	int rv;
+
+	if (debug) {
+		(void) printf("replace2(%s, %s)\n", from, to);
+	}
+
+	/*
+	 * If -n has been given, just print commands.
+	 */
+	if (noexec) {
+		logmsg(1, "link %s to %s%s\n", to, from, bynames[trusted]);
+		return(1);
+	}
+
+	/*
+	 * Before we throw "to" away, relink it to a temporary file.
+	 */
+	(void) time(&clock);
+	(void) sprintf(newname, "%s%4.4x%4.4x", to,
+						(unsigned) (getpid() & 0xffff),
+						(unsigned) clock & 0xffff);
+	newbase = newname + (base - to);
+	PROBE2(replace__start, from, to);
+
+	/*
+	 * Links are made only once every class has been looked at, so
+	 * either file may have been written to since they were compared.
+	 */
+	if (!unchanged(op, dirfd)) {
+		stats.s_rewritten++;
+		error(0, "%s or %s has changed since they were compared; not linked",
+								to, from);
+		return(0);
+	}
+
+	if (debug) {
+		(void) puts("replace2 - creating save file");
+	}
+
+	/*
+	 * Set priority high so that anyone trying to access the files
+	 * will be less likely to notice their disappearance.
+	 * We must be careful to lower it again afterwards.
+	 */
+	raisepriority();
+
+	start = lattime();
+	rv = renameat(dirfd, base, dirfd, newbase);
+	latency(LAT_RENAME, start);
+	if (rv == -1) {			/* cannot save file */
+		PROBE2(replace__rename, to, -errno);
+		if (debug) {
+			error(1, "rename('%s', '%s')", to, newname);
+		}
+		lowerpriority();
+		return(0);
+	}
+
+	PROBE2(replace__rename, to, 0);
+
+	/*
+	 * Now try and link them together.
+	 */
+	if (debug) {
+		(void) puts("replace2 - linking");
+	}
+
+	start = lattime();
+	rv = linkat(AT_FDCWD, from, dirfd, base, 0);
+	latency(LAT_LINK, start);
+	if (rv == -1) {
+		PROBE2(replace__link, to, -errno);
+		if (renameat(dirfd, newbase, dirfd, base) == -1) {
 			if (debug) {
 				error(1, "rename(%s, %s)", newname, to);
 			}
-			lowerpriority();
-			return(0);
+			lowerpriority();
+			return(0);
+		} else {
+			urgent(1, "failed to link %s to %s - copy has been left on %s", to, from, newname);
+			lowerpriority();
+			return(-1);
+		}
+	}
+
+	PROBE2(replace__link, to, 0);
+
+	/*
+	 * Don't forget to lower the priority again.
+	 */
+	lowerpriority();
+
+	/*
+	 * The name is now the kept file's; writeindex() checks it
+	 * against that file's modification time.
+	 */
+	op->o_file->i_mtime = op->o_keep->i_mtime;
+
+	/*
+	 * This should never fail - we have only just created it.
+	 */
+	start = lattime();
+	rv = unlinkat(dirfd, newbase, 0);
+	latency(LAT_UNLINK, start);
+	if (rv == -1) {
+		PROBE2(replace__unlink, to, -errno);
+		patherror(newname, "cannot remove temporary file %s", newname);
+	} else {
+		PROBE2(replace__unlink, to, 0);
+	}
+
+	/*
+	 * Only print out what we are doing when we have succeeded.
+	 */
+	if (verbose) {
+		logmsg(1, "linking %s to %s%s\n", to, from, bynames[trusted]);
+	}
+
+	return(1);
+}
+
+/*
+ * Are the files of op still as plan() found them?  The one to be
+ * replaced must have the same inode, size and times.  Its change time
+ * may have moved on only if it has other names, and only since the
+ * links began to be made, as replacing those changes it; so may the
+ * kept file's, which gains a link each time.
+ */
+static int
+unchanged(op, dirfd)
+Op *op;
+int dirfd;
+{
+	struct stat stbuf;
+	register Info *ip = op->o_file;
+
+	if (fstatat(dirfd, op->o_base, &stbuf, AT_SYMLINK_NOFOLLOW) == -1
+	  || stbuf.st_ino != ip->i_ino || stbuf.st_size != op->o_length
+	  || stbuf.st_mtim.tv_sec != ip->i_mtime.tv_sec
+	  || stbuf.st_mtim.tv_nsec != ip->i_mtime.tv_nsec) {
+		return(0);
+	}
+	if ((stbuf.st_ctim.tv_sec != ip->i_ctime.tv_sec
+	    || stbuf.st_ctim.tv_nsec != ip->i_ctime.tv_nsec)
+	  && (ip->i_nlink == 1 || stbuf.st_ctim.tv_sec < linkstart.tv_sec
+	    || (stbuf.st_ctim.tv_sec == linkstart.tv_sec
+	      && stbuf.st_ctim.tv_nsec < linkstart.tv_nsec))) {
+		return(0);
+	}
+
+	ip = op->o_keep;
+	if (fstatat(AT_FDCWD, op->o_from, &stbuf, AT_SYMLINK_NOFOLLOW) == -1
+	  || stbuf.st_ino != ip->i_ino || stbuf.st_size != op->o_length
+	  || stbuf.st_mtim.tv_sec != ip->i_mtime.tv_sec
+	  || stbuf.st_mtim.tv_nsec != ip->i_mtime.tv_nsec) {
+		return(0);
+	}
+	return(1);
+}
+
+/*
+ * Given a filename and the address of a header structure, fill it in with
+ * the size and a pointer to a new info structure, which is filled in with
+ * the filename and inode number.
+ * If file is a symbolic link, only follow it if it is a file,
+ * or if it is a directory and the -s flag has been given.
+ * Returns NOSUCHFILE, ISDIR or NOTDIR as appropriate.
+ */
+static int
+newinfo(filename, directory, headerp)
+register char *filename;
+register char *directory;
+register Head *headerp;
+{
+	struct stat stbuf;
+	uint64_t mnt;
+	uint64_t attrs;			/* statx attributes */
+	uid_t uid;			/* owner of the name itself */
+	register Info *infop;
+	register char *cp;
+
+	if (debug) {
+		(void) printf("newinfo(%s, %s)\n", filename, directory);
+	}
+
+	cp = mkpath(directory, filename);
+
+	/*
+	 * if the file does not exist, ignore it.
+	 */
+	if (xstat(cp, AT_SYMLINK_NOFOLLOW, &stbuf, &mnt, &attrs) == -1) {
+		free(cp);
+		return(NOSUCHFILE);
+	}
+	PROBE3(file__stat, cp, (long long) stbuf.st_size,
+						(long long) stbuf.st_ino);
+	uid = stbuf.st_uid;
+
+	/*
+	 * ignore directories and special files - we can't rationalise them.
+	 */
+	switch (stbuf.st_mode & S_IFMT) {
+	case S_IFLNK:
+		/*
+		 * handle symlinks; first stat what it points to.
+		 */
+		if (!symbolic) {
+			return(NOSUCHFILE);
+		}
+
+		if (xstat(cp, 0, &stbuf, &mnt, &attrs) == -1) {
+			free(cp);
+			return(NOSUCHFILE);		/* nothing to point to */
+		}
+
+		switch (stbuf.st_mode & S_IFMT) {
+		case S_IFDIR:			/* symlink to directory */
+			free(cp);
+			return(ISDIR);
+			/*NOTREACHED*/
+		case S_IFREG:			/* symlink to regular file */
+			break;
+		default:			/* symlink to special file */
+			free(cp);
+			return(NOSUCHFILE);
+		}
+		break;
+
+	case S_IFDIR:				/* directory */
+		free(cp);
+		return(ISDIR);
+
+	case S_IFREG:				/* a regular file */
+		break;
+
+	default:				/* special file */
+		free(cp);
+		return(NOSUCHFILE);
+	}
+
+	/*
+	 * ignore empty files, if that's what they asked for
+	 */
+	if (ignore_empty && stbuf.st_size == 0) {
+		free(cp);
+		return(NOSUCHFILE);
+	}
+
+	/*
+	 * ignore files whose contents are offline, since reading
+	 * them would bring them back.
+	 */
+	if (!stubs && offline(cp, &stbuf, attrs)) {
+		if (debug) {
+			(void) printf("%s is offline\n", cp);
+		}
+		stats.s_offline++;
+		free(cp);
+		return(NOSUCHFILE);
+	}
+
+	/*
+	 * allocate memory for the new file info.
+	 */
+	infop = (Info *) malloc(sizeof(Info));
+	if (infop == NULL) {
+		fatal("Out of memory");
+	}
+
+	/*
+	 * fill in the information. we must zero all un-initialised
+	 * elements, since malloc doesn't do this.
+	 */
+	infop->i_name = cp;
+	infop->i_ino = stbuf.st_ino;
+	infop->i_uid = uid;
+	infop->i_nlink = stbuf.st_nlink;
+	infop->i_mtime = stbuf.st_mtim;
+	infop->i_ctime = stbuf.st_ctim;
+	infop->i_hashed = DIG_NONE;
+	infop->i_trusted = 0;
+	infop->i_fixed = 0;
+	infop->i_indexed = 0;
+	infop->i_linked = 0;
+	infop->i_crcok = 0;
+	infop->i_isverity = (attrs & STATX_ATTR_VERITY) != 0;
+	infop->i_verity = NULL;
+	infop->i_next = NULL;
+	infop->i_same = NULL;
+	infop->i_dir = NULL;
+
+	headerp->h_size = stbuf.st_size;
+	headerp->h_dev = stbuf.st_dev;
+	headerp->h_mnt = mnt;
+	headerp->h_uid = stbuf.st_uid;
+	headerp->h_gid = stbuf.st_gid;
+	headerp->h_perms = stbuf.st_mode & ALLPERMS;
+	headerp->h_info = infop;
+
+	stats.s_files++;
+
+	return(0);
+}
+
+/*
+ * Decide whether the named file, described by *stp, is an offline
+ * stub left by a hierarchical storage manager: one that has next to
+ * no blocks allocated for its size but isn't sparse.  A sparse file
+ * has holes where it has no blocks, so if SEEK_DATA/SEEK_HOLE find
+ * far more data than there are blocks to hold it, the data must be
+ * somewhere else, unless it is compressed; attrs are its statx
+ * attributes.  Returns 1 if so.
+ */
+static int
+offline(name, stp, attrs)
+char *name;
+struct stat *stp;
+uint64_t attrs;
+{
+	int fd;
+	off_t data, hole;		/* extent found */
+	off_t found = 0;		/* data found so far */
+	off_t allocated;		/* space actually allocated */
+	register int i;
+
+	allocated = (off_t) stp->st_blocks * 512;
+	if (stp->st_size < STUBMIN || allocated * STUBRATIO >= stp->st_size
+	  || (attrs & STATX_ATTR_COMPRESSED) || thinblocks(name)) {
+		return(0);
+	}
+
+	/*
+	 * Opening it doesn't bring it back; reading does.
+	 */
+	fd = open(name, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+	if (fd == -1) {
+		return(0);
+	}
+
+	hole = 0;
+	for (i = 0; i < STUBEXTENTS && found <= allocated * STUBRATIO; i++) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data == -1) {
+			break;			/* ENXIO: nothing but holes */
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1) {
+			break;
+		}
+		found += hole - data;
+		if (hole >= stp->st_size) {
+			break;
+		}
+	}
+
+	(void) close(fd);
+
+	return(found > allocated * STUBRATIO);
+}
+
+/*
+ * Could the named file's filesystem hold data in fewer blocks than
+ * its length, or not know how many it holds?  Compressing filesystems
+ * can, the more so for the files that compress best, and FUSE and NFS
+ * report what the filesystem behind them says, if anything.
+ */
+static int
+thinblocks(name)
+char *name;
+{
+	struct statfs sfs;
+
+	if (statfs(name, &sfs) == -1) {
+		return(1);
+	}
+	switch ((unsigned long) sfs.f_type) {
+	case BTRFS_SUPER_MAGIC:
+	case ZFS_SUPER_MAGIC:
+	case BCACHEFS_SUPER_MAGIC:
+	case F2FS_SUPER_MAGIC:
+	case SQUASHFS_MAGIC:
+	case EROFS_SUPER_MAGIC_V1:
+	case FUSE_SUPER_MAGIC:
+	case NFS_SUPER_MAGIC:
+		return(1);
+	}
+	return(0);
+}
+
+/*
+ * stat() the named file, or lstat() it if flags is AT_SYMLINK_NOFOLLOW,
+ * and also find the ID of the mount it is on, which is 0 if the system
+ * can't tell us.
+ */
+static int
+xstat(name, flags, stp, mntp, attrp)
+char *name;
+int flags;
+struct stat *stp;
+uint64_t *mntp;
+uint64_t *attrp;
+{
+	struct statx stx;
+	uint64_t start = lattime();
+	int rv;
+
+	rv = statx(AT_FDCWD, name, flags, STATX_BASIC_STATS | STATX_MNT_ID, &stx);
+	latency(LAT_STAT, start);
+	if (rv == -1) {
+		if (errno != ENOSYS) {
+			return(-1);
+		}
+		*mntp = 0;
+		if (attrp != NULL) {
+			*attrp = 0;
+		}
+		return(flags & AT_SYMLINK_NOFOLLOW ? lstat(name, stp)
+						   : stat(name, stp));
+	}
+
+	(void) memset(stp, 0, sizeof(*stp));
+	stp->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	stp->st_ino = stx.stx_ino;
+	stp->st_mode = stx.stx_mode;
+	stp->st_nlink = stx.stx_nlink;
+	stp->st_uid = stx.stx_uid;
+	stp->st_gid = stx.stx_gid;
+	stp->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	stp->st_size = stx.stx_size;
+	stp->st_blksize = stx.stx_blksize;
+	stp->st_blocks = stx.stx_blocks;
+	stp->st_atim.tv_sec = stx.stx_atime.tv_sec;
+	stp->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	stp->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	stp->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	stp->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	stp->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+	*mntp = (stx.stx_mask & STATX_MNT_ID) ? stx.stx_mnt_id : 0;
+	if (attrp != NULL) {
+		*attrp = stx.stx_attributes & stx.stx_attributes_mask;
+	}
+
+	return(0);
+}
+
+/*
+ * fstat() an open file, timing it with the other stat calls.
+ */
+static int
+xfstat(fd, stp)
+int fd;
+struct stat *stp;
+{
+	uint64_t start = lattime();
+	int rv;
+
+	rv = fstat(fd, stp);
+	latency(LAT_STAT, start);
+	return(rv);
+}
+
+/*
+ * Look up a directory in the table of those we have been into.
+ * If it is there, return 1 with the mount it was reached by in *seenp;
+ * if not, add it and return 0.
+ */
+static int
+visited(dev, ino, mnt, seenp)
+dev_t dev;
+ino_t ino;
+uint64_t mnt;
+uint64_t *seenp;
+{
+	register Visit *vp;
+
+	(void) pthread_mutex_lock(&visitlock);
+	vp = visit(dev, ino, mnt);
+	if (vp != NULL) {
+		*seenp = vp->v_mnt;
+	}
+	(void) pthread_mutex_unlock(&visitlock);
+
+	return(vp != NULL);
+}
+
+/*
+ * The work of visited(), with the table locked: return the entry if
+ * there is one, or add it and return NULL.
+ */
+static Visit *
+visit(dev, ino, mnt)
+dev_t dev;
+ino_t ino;
+uint64_t mnt;
+{
+	Visit *old;
+	size_t oldmax, i;
+	register Visit *vp;
+	uint64_t h;
+
+	if (nvisits * 2 >= maxvisits) {
+		old = visits;
+		oldmax = maxvisits;
+		maxvisits = maxvisits ? maxvisits * 2 : 1024;
+		visits = (Visit *) calloc(maxvisits, sizeof(Visit));
+		if (visits == NULL) {
+			fatal("Out of memory");
+		}
+		nvisits = 0;
+		for (i = 0; i < oldmax; i++) {
+			if (old[i].v_ino != 0) {
+				(void) visit(old[i].v_dev, old[i].v_ino,
+							old[i].v_mnt);
+			}
+		}
+		free(old);
+	}
+
+	h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	for (i = (h >> 32) & (maxvisits - 1); ; i = (i + 1) & (maxvisits - 1)) {
+		vp = &visits[i];
+		if (vp->v_ino == 0) {
+			break;
+		}
+		if (vp->v_dev == dev && vp->v_ino == ino) {
+			return(vp);
+		}
+	}
+
+	vp->v_dev = dev;
+	vp->v_ino = ino;
+	vp->v_mnt = mnt;
+	nvisits++;
+
+	return(NULL);
+}
+
+/*
+ * return a new head structure, uninitialised.
+ */
+static Head *
+newhead()
+{
+	register Head *hp;
+
+	hp = (Head *) malloc(sizeof(Head));
+	if (hp == NULL)
+		fatal("Out of memory");
+
+	return(hp);
+}
+
+/*
+ * compare the given files. returns 0 for identical files, and 1 if they are
+ * different. if files are not readable, they are considered to be different,
+ * and -1 is returned.
+ * with -x, if neither file's digest is known, it is found as they are
+ * read, and if they turn out to be identical, cached on both; if they
+ * differ but were both read to the end, each one's is cached.
+ */
+static int
+compare(a, b)
+Info *a, *b;
+{
+	char *file1 = a->i_name;
+	char *file2 = b->i_name;
+	Sha256 ctx;			/* digest of what has matched */
+	int hashing;			/* whether to find it */
+	register int fd1, fd2;		/* file descriptors */
+	register ssize_t n1, n2;	/* count of bytes read */
+	register int retval;		/* return value */
+	char *buf1, *buf2;		/* buffers for comparison */
+	off_t offset = 0;		/* how far we have got */
+	off_t differ = -1;		/* where they first differ */
+	off_t read1 = 0, read2 = 0;	/* bytes read from each */
+	register ssize_t i;
+	struct stat stbuf;
+	Devtune *tp;			/* read sizes on this device */
+	int step, top;			/* size of this read, and the largest */
+	size_t len;
+	double start;
+
+	PROBE2(compare__start, file1, file2);
+
+	fd1 = timedopen(file1);
+	if (fd1 == -1) {
+		PROBE5(compare__end, file1, file2, 0LL, -1LL, -1);
+		return(-1);
+	}
+
+	fd2 = timedopen(file2);
+	if (fd2 == -1) {
+		(void) close(fd1);
+		PROBE5(compare__end, file1, file2, 0LL, -1LL, -1);
+		return(-1);
+	}
+
+	stats.s_compares++;
+
+	/*
+	 * Whatever the cap, the first read is RAMPMIN, so that files
+	 * which differ near the start cost no more than that to tell
+	 * apart, however big the buffers.
+	 */
+	tp = devtune(xfstat(fd1, &stbuf) == 0 ? stbuf.st_dev : 0);
+	top = tp->t_compares++ % RAMPPROBE == 0 ? NRAMP - 1 : tp->t_cap;
+	step = 0;
+
+	hashing = hashcache && a->i_hashed < DIG_CACHED
+			    && b->i_hashed < DIG_CACHED;
+	if (hashing) {
+		sha256init(&ctx);
+	}
+
+	/*
+	 * compare the contents of the two files.
+	 */
+	buf1 = getbuf();
+	buf2 = getbuf();
+	retval = 0;		/* files initially considered identical */
+	do {
+		len = (size_t) RAMPMIN << step;
+		start = now();
+		n1 = timedread(fd1, buf1, len, -1, file1);
+		n2 = n1 < 0 ? -1 : timedread(fd2, buf2, len, -1, file2);
+		if (n1 == (ssize_t) len && n2 == (ssize_t) len) {
+			tune(tp, step, 2.0 * len, now() - start);
+		}
+		if (step < top) {
+			step++;
+		}
+		read1 += n1 > 0 ? n1 : 0;
+		read2 += n2 > 0 ? n2 : 0;
+		if (n1 < 0 || n2 < 0) {
+			/*
+			 * can't read one of them (or it stalled).
+			 */
+			retval = -1;
+			break;
+		} else if (n1 != n2) {
+			/*
+			 * files are different sizes.
+			 */
+			retval = 1;
+			differ = offset + (n1 < n2 ? n1 : n2);
+			break;
 		} else {
-			error(1, "failed to link %s to %s - copy has been left on %s\n", to, from, newname);
-			lowerpriority();
-			return(-1);
+			if (memcmp(buf1, buf2, n1) != 0) {
+				retval = 1;
+				for (i = 0; buf1[i] == buf2[i]; i++) {
+					;
+				}
+				differ = offset + i;
+				break;
+			}
+			if (hashing) {
+				sha256update(&ctx, buf1, n1);
+			}
 		}
-	}
+		offset += n1;
+	} while (n1 > 0 && n2 > 0);
 
 	/*
-	 * Don't forget to lower the priority again.
+	 * if they differ only in their last reads, each has been read to
+	 * its end: what matched is in ctx, and adding each one's last
+	 * read to a copy of it gives its digest.
 	 */
-	lowerpriority();
+	if (retval == 1 && hashing) {
+		lastdigest(fd1, a, &ctx, buf1, n1, read1);
+		lastdigest(fd2, b, &ctx, buf2, n2, read2);
+	}
+
+	putbuf(buf2);
+	putbuf(buf1);
 
 	/*
-	 * This should never fail - we have only just created it.
+	 * if they are the same, and we know the digest of one (or have
+	 * just found it), the other has it too.
 	 */
-	if (unlink(newname) == -1) {
-		error(1, "cannot remove temporary file %s", newname);
+	if (retval == 0 && hashcache) {
+		if (hashing) {
+			sha256final(&ctx, a->i_digest);
+			comparedigest(fd1, a, NULL);
+		}
+		if (a->i_hashed >= b->i_hashed) {
+			comparedigest(fd2, b, a);
+		} else {
+			comparedigest(fd1, a, b);
+		}
 	}
 
 	/*
-	 * Only print out what we are doing when we have succeeded.
+	 * don't forget to close them files ...
 	 */
-	if (verbose) {
-		(void) printf("linking %s to %s\n", to, from);
+	(void) close(fd1);
+	(void) close(fd2);
+
+	stats.s_bytesread += read1 + read2;
+	if (wheredepth > 0) {
+		attribute(file1, read1, 1, 0);
+		attribute(file2, read2, 1, 0);
 	}
 
-	return(1);
+	PROBE5(compare__end, file1, file2, (long long) (read1 + read2),
+					(long long) differ, retval);
+	return(retval);
 }
 
 /*
- * Given a filename and the address of a header structure, fill it in with
- * the size and a pointer to a new info structure, which is filled in with
- * the filename and inode number.
- * If file is a symbolic link, only follow it if it is a file,
- * or if it is a directory and the -s flag has been given.
- * Returns NOSUCHFILE, ISDIR or NOTDIR as appropriate.
+ * find the read sizes for a device, starting it off with the largest.
  */
-static int
-newinfo(filename, directory, headerp)
-register char *filename;
-register char *directory;
-register Head *headerp;
+static Devtune *
+devtune(dev)
+dev_t dev;
+{
+	register int i;
+
+	for (i = 0; i < ntunes; i++) {
+		if (tunes[i].t_dev == dev) {
+			return(&tunes[i]);
+		}
+	}
+	tunes = (Devtune *) realloc(tunes, (ntunes + 1) * sizeof(Devtune));
+	if (tunes == NULL) {
+		fatal("Out of memory");
+	}
+	(void) memset(&tunes[ntunes], 0, sizeof(Devtune));
+	tunes[ntunes].t_dev = dev;
+	tunes[ntunes].t_cap = NRAMP - 1;
+	return(&tunes[ntunes++]);
+}
+
+/*
+ * note that "bytes" were read from a device in reads of size step
+ * in "secs" seconds, and reconsider its cap.
+ */
+static void
+tune(tp, step, bytes, secs)
+Devtune *tp;
+int step;
+double bytes, secs;
+{
+	double rate, best = 0;
+	register int i;
+
+	if (step < RAMPTUNE || secs <= 0) {
+		return;
+	}
+	rate = bytes / secs;
+	if (tp->t_samples[step]++ == 0) {
+		tp->t_rate[step] = rate;
+	} else {
+		tp->t_rate[step] += RAMPWEIGHT * (rate - tp->t_rate[step]);
+	}
+
+	for (i = RAMPTUNE; i < NRAMP; i++) {
+		if (tp->t_samples[i] < RAMPSAMPLES) {
+			return;
+		}
+		if (tp->t_rate[i] > best) {
+			best = tp->t_rate[i];
+		}
+	}
+	for (i = RAMPTUNE; i < NRAMP; i++) {
+		if (tp->t_rate[i] >= RAMPGAIN * best) {
+			break;
+		}
+	}
+	tp->t_cap = i;
+}
+
+/*
+ * record a digest found by compare() for the file ip, open on fd:
+ * the one already in ip->i_digest, or, if "from" is given, that of
+ * "from", which is identical, and as far known as it is.  it is cached
+ * if the file is still the one we looked at, unless it is only a hint.
+ */
+static void
+comparedigest(fd, ip, from)
+int fd;
+Info *ip;
+Info *from;
 {
 	struct stat stbuf;
-	register Info *infop;
-	register char *cp;
+	int level = from != NULL ? from->i_hashed : DIG_READ;
 
-	if (debug) {
-		(void) printf("newinfo(%s, %s)\n", filename, directory);
+	if (ip->i_hashed >= level) {
+		return;
+	}
+	if (from != NULL) {
+		(void) memcpy(ip->i_digest, from->i_digest, SHA256_LEN);
 	}
+	if (xfstat(fd, &stbuf) == -1 || stbuf.st_ino != ip->i_ino
+	  || stbuf.st_mtim.tv_sec != ip->i_mtime.tv_sec
+	  || stbuf.st_mtim.tv_nsec != ip->i_mtime.tv_nsec) {
+		return;
+	}
+	ip->i_hashed = level;
+	stats.s_comparedigests++;
+	if (level >= DIG_CACHED) {
+		putcache(fd, ip, &stbuf);
+	}
+}
 
-	cp = mkpath(directory, filename);
+/*
+ * having found that a file differs from another only in its last read
+ * of n bytes from buf, the part before being in ctx, give it its digest
+ * if it has been read to the end (total bytes in all).
+ */
+static void
+lastdigest(fd, ip, ctx, buf, n, total)
+int fd;
+Info *ip;
+Sha256 *ctx;
+char *buf;
+ssize_t n;
+off_t total;
+{
+	Sha256 own;
+	struct stat stbuf;
 
-	/*
-	 * if the file does not exist, ignore it.
-	 */
-	if (lstat(cp, &stbuf) == -1) {
-		free(cp);
-		return(NOSUCHFILE);
+	if (n < 0 || xfstat(fd, &stbuf) == -1 || stbuf.st_size != total) {
+		return;
 	}
-	
-	/*
-	 * ignore directories and special files - we can't rationalise them.
-	 */
-	switch (stbuf.st_mode & S_IFMT) {
-	case S_IFLNK:
-		/*
-		 * handle symlinks; first stat what it points to.
-		 */
-		if (!symbolic) {
-			return(NOSUCHFILE);
+	own = *ctx;
+	sha256update(&own, buf, n);
+	sha256final(&own, ip->i_digest);
+	comparedigest(fd, ip, NULL);
+}
+
+/*
+ * raise process priority for critical code.
+ * note that if we are already running at a high priority,
+ * this may slow us down slightly between critical sections.
+ */
+static void
+raisepriority()
+{
+	if (our_uid == -1) {
+		our_uid = geteuid();
+	}
+	if (our_uid == 0) {
+		(void) nice(PRIORITY);
+		niceness += PRIORITY;
+	}
+}
+
+/*
+ * put the priority back where it was.
+ */
+static void
+lowerpriority()
+{
+	if (our_uid == 0) {
+		(void) nice(-niceness);
+		niceness = 0;
+	}
+}
+
+/*
+ * return the time now, in seconds, for timing things.
+ */
+static double
+now()
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * return the time now in nanoseconds, for latency(), or 0 if we aren't
+ * keeping statistics.
+ */
+static uint64_t
+lattime()
+{
+	struct timespec ts;
+
+	if (!statistics) {
+		return(0);
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * record the latency of an operation of the given kind that began at
+ * "start", as returned by lattime().
+ */
+static void
+latency(op, start)
+int op;
+uint64_t start;
+{
+	uint64_t ns;
+
+	if (!statistics) {
+		return;
+	}
+	ns = lattime() - start;
+	lat.l_count[op][latbucket(ns)]++;
+	lat.l_total[op]++;
+	if (ns > lat.l_max[op]) {
+		lat.l_max[op] = ns;
+	}
+}
+
+/*
+ * add the calling thread's latencies into alllat, and start it again.
+ */
+static void
+latmerge()
+{
+	register int op, b;
+
+	if (!statistics) {
+		return;
+	}
+	(void) pthread_mutex_lock(&latlock);
+	for (op = 0; op < NLAT; op++) {
+		for (b = 0; b < LATBUCKETS; b++) {
+			alllat.l_count[op][b] += lat.l_count[op][b];
+		}
+		alllat.l_total[op] += lat.l_total[op];
+		if (lat.l_max[op] > alllat.l_max[op]) {
+			alllat.l_max[op] = lat.l_max[op];
 		}
+	}
+	(void) pthread_mutex_unlock(&latlock);
+	(void) memset(&lat, 0, sizeof(lat));
+}
 
-		if (stat(cp, &stbuf) == -1) {
-			free(cp);
-			return(NOSUCHFILE);		/* nothing to point to */
+/*
+ * which histogram bucket does a latency of ns nanoseconds go in?
+ */
+static int
+latbucket(ns)
+uint64_t ns;
+{
+	register int shift;
+
+	if (ns < 2 * LATSUB) {
+		return(ns);
+	}
+	shift = 63 - __builtin_clzll(ns) - LATSUBBITS;
+	return(2 * LATSUB + (shift - 1) * LATSUB + (ns >> shift) - LATSUB);
+}
+
+/*
+ * the largest latency that would go in bucket b.
+ */
+static uint64_t
+latvalue(b)
+int b;
+{
+	register int shift;
+
+	if (b < 2 * LATSUB) {
+		return(b);
+	}
+	shift = (b - 2 * LATSUB) / LATSUB + 1;
+	return((((uint64_t) ((b - 2 * LATSUB) % LATSUB + LATSUB + 1)) << shift) - 1);
+}
+
+/*
+ * the latency below which the fraction q of operations of the given
+ * kind fell.
+ */
+static uint64_t
+percentile(op, q)
+int op;
+double q;
+{
+	uint64_t want, seen = 0;
+	register int b;
+
+	want = (uint64_t) ceil(q * alllat.l_total[op]);
+	if (want == 0) {
+		want = 1;
+	}
+	for (b = 0; b < LATBUCKETS; b++) {
+		seen += alllat.l_count[op][b];
+		if (seen >= want) {
+			return(min(latvalue(b), alllat.l_max[op]));
 		}
+	}
+	return(alllat.l_max[op]);
+}
 
-		switch (stbuf.st_mode & S_IFMT) {
-		case S_IFDIR:			/* symlink to directory */
-			free(cp);
-			return(ISDIR);
-			/*NOTREACHED*/
-		case S_IFREG:			/* symlink to regular file */
+/*
+ * open the named file for reading, giving up after -t seconds.
+ * a file that has stalled before is not tried again.
+ */
+static int
+timedopen(name)
+char *name;
+{
+	int fd;
+	uint64_t start;
+
+	if (quarantined(name)) {
+		errno = ETIMEDOUT;
+		return(-1);
+	}
+
+	start = lattime();
+	if (timeout == 0) {
+		fd = open(name, O_RDONLY);
+	} else {
+		fd = (int) iowait(IO_OPEN, name, -1, NULL, 0, 0);
+	}
+	latency(LAT_OPEN, start);
+	if (fd == -1 && errno == ETIMEDOUT) {
+		quarantine(name, "open");
+	}
+
+	return(fd);
+}
+
+/*
+ * read up to len bytes from fd, which is open on "name", at offset off
+ * or, if off is -1, from where the last read left off; giving up after
+ * -t seconds.  if we give up, the file is put in quarantine, and buf,
+ * which the helper may yet read into, is taken out of the pool.
+ */
+static ssize_t
+timedread(fd, buf, len, off, name)
+int fd;
+char *buf;
+size_t len;
+off_t off;
+char *name;
+{
+	ssize_t n;
+	uint64_t start = lattime();
+
+	if (timeout == 0) {
+		n = off == -1 ? read(fd, buf, len) : pread(fd, buf, len, off);
+		latency(LAT_READ, start);
+		return(n);
+	}
+
+	n = iowait(IO_READ, name, fd, buf, len, off);
+	latency(LAT_READ, start);
+	if (n == -1 && errno == ETIMEDOUT) {
+		quarantine(name, "read");
+	}
+
+	return(n);
+}
+
+/*
+ * hand an open or read to this thread's helper, starting one if need
+ * be, and wait up to -t seconds for it.  if it takes longer, the
+ * helper is abandoned with the call, and -1 returned with errno set
+ * to ETIMEDOUT.  if no helper can be started, the call is made here.
+ */
+static ssize_t
+iowait(op, name, fd, buf, len, off)
+int op;
+char *name;
+int fd;
+char *buf;
+size_t len;
+off_t off;
+{
+	register Iohelper *xp = iohelper;
+	struct timespec ts;
+	sigset_t all, old;
+	pthread_t tid;
+	ssize_t n;
+	int rv = 0;
+
+	if (xp == NULL) {
+		xp = (Iohelper *) calloc(1, sizeof(Iohelper));
+		if (xp == NULL) {
+			fatal("Out of memory");
+		}
+		(void) pthread_mutex_init(&xp->x_lock, NULL);
+		(void) pthread_cond_init(&xp->x_cond, NULL);
+		(void) sigfillset(&all);
+		(void) pthread_sigmask(SIG_SETMASK, &all, &old);
+		rv = pthread_create(&tid, NULL, iothread, xp);
+		(void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (rv != 0) {
+			free(xp);
+			if (op == IO_OPEN) {
+				return(open(name, O_RDONLY));
+			}
+			return(off == -1 ? read(fd, buf, len)
+					 : pread(fd, buf, len, off));
+		}
+		(void) pthread_detach(tid);
+		iohelper = xp;
+	}
+
+	(void) pthread_mutex_lock(&xp->x_lock);
+	xp->x_op = op;
+	xp->x_name = name;
+	xp->x_fd = fd;
+	xp->x_buf = buf;
+	xp->x_len = len;
+	xp->x_off = off;
+	xp->x_done = 0;
+	(void) pthread_cond_broadcast(&xp->x_cond);
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+	while (!xp->x_done && rv != ETIMEDOUT) {
+		rv = pthread_cond_timedwait(&xp->x_cond, &xp->x_lock, &ts);
+	}
+
+	if (!xp->x_done) {
+		xp->x_abandoned = 1;
+		(void) pthread_mutex_unlock(&xp->x_lock);
+		iohelper = NULL;
+		if (op == IO_READ) {
+			lostbuf(buf);
+		}
+		errno = ETIMEDOUT;
+		return(-1);
+	}
+
+	n = xp->x_result;
+	xp->x_op = 0;
+	errno = xp->x_errno;
+	(void) pthread_mutex_unlock(&xp->x_lock);
+
+	return(n);
+}
+
+/*
+ * an I/O helper: make each call posted to it, until one is abandoned;
+ * then clean up after that one and go.
+ */
+static void *
+iothread(void *arg)
+{
+	register Iohelper *xp = (Iohelper *) arg;
+	ssize_t n;
+
+	(void) pthread_mutex_lock(&xp->x_lock);
+	for (;;) {
+		while (xp->x_op == 0 || xp->x_done) {
+			(void) pthread_cond_wait(&xp->x_cond, &xp->x_lock);
+		}
+		(void) pthread_mutex_unlock(&xp->x_lock);
+
+		if (xp->x_op == IO_OPEN) {
+			n = open(xp->x_name, O_RDONLY);
+		} else if (xp->x_off == -1) {
+			n = read(xp->x_fd, xp->x_buf, xp->x_len);
+		} else {
+			n = pread(xp->x_fd, xp->x_buf, xp->x_len, xp->x_off);
+		}
+
+		(void) pthread_mutex_lock(&xp->x_lock);
+		xp->x_result = n;
+		xp->x_errno = errno;
+		xp->x_done = 1;
+		if (xp->x_abandoned) {
 			break;
-		default:			/* symlink to special file */
-			free(cp);
-			return(NOSUCHFILE);
 		}
-		break;
+		(void) pthread_cond_broadcast(&xp->x_cond);
+	}
+	(void) pthread_mutex_unlock(&xp->x_lock);
 
-	case S_IFDIR:				/* directory */
-		free(cp);
-		return(ISDIR);
+	if (xp->x_op == IO_OPEN && xp->x_result >= 0) {
+		(void) close((int) xp->x_result);
+	} else if (xp->x_op == IO_READ) {
+		free(xp->x_buf);
+	}
+	(void) pthread_cond_destroy(&xp->x_cond);
+	(void) pthread_mutex_destroy(&xp->x_lock);
+	free(xp);
 
-	case S_IFREG:				/* a regular file */
-		break;
+	return(NULL);
+}
+
+/*
+ * a helper was abandoned while reading into buf, one of this thread's
+ * pool: leave it to the helper, and let the pool allocate another.
+ */
+static void
+lostbuf(buf)
+char *buf;
+{
+	register Bufpool *pp = &bufpool;
+	register int i;
 
-	default:				/* special file */
-		free(cp);
-		return(NOSUCHFILE);
+	for (i = 0; i < pp->p_used; i++) {
+		if (pp->p_bufs[i] == buf) {
+			pp->p_bufs[i] = NULL;
+		}
 	}
+}
 
-	/*
-	 * ignore empty files, if that's what they asked for
-	 */
-	if (ignore_empty && stbuf.st_size == 0) {
-		free(cp);
-		return(NOSUCHFILE);
-	}
+/*
+ * hash a file name, for the quarantine table.
+ */
+static uint64_t
+qhash(name)
+char *name;
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
 
-	/*
-	 * allocate memory for the new file info.
-	 */
-	infop = (Info *) malloc(sizeof(Info));
-	if (infop == NULL) {
-		fatal("Out of memory");
+	while (*name != '\0') {
+		h = (h ^ (unsigned char) *name++) * 0x100000001b3ULL;
 	}
+	return(h);
+}
 
-	/*
-	 * fill in the information. we must zero all un-initialised
-	 * elements, since malloc doesn't do this.
-	 */
-	infop->i_name = cp;
-	infop->i_ino = stbuf.st_ino;
-	infop->i_next = NULL;
-	infop->i_dir = NULL;
-
-	headerp->h_size = stbuf.st_size;
-	headerp->h_dev = stbuf.st_dev;
-	headerp->h_uid = stbuf.st_uid;
-	headerp->h_gid = stbuf.st_gid;
-	headerp->h_perms = stbuf.st_mode & ALLPERMS;
-	headerp->h_info = infop;
+/*
+ * has the named file already stalled?
+ */
+static int
+quarantined(name)
+char *name;
+{
+	register Qentry *qp;
 
+	if (nquarantine == 0) {
+		return(0);
+	}
+	for (qp = qtable[qhash(name) % QBUCKETS]; qp != NULL; qp = qp->q_next) {
+		if (strcmp(qp->q_name, name) == 0) {
+			return(1);
+		}
+	}
 	return(0);
 }
 
 /*
- * return a new head structure, uninitialised.
+ * note that the named file stalled in the given operation,
+ * so that it is left alone from now on.
  */
-static Head *
-newhead()
+static void
+quarantine(name, what)
+char *name;
+char *what;
 {
-	register Head *hp;
+	register Qentry *qp;
+	uint64_t b;
 
-	hp = (Head *) malloc(sizeof(Head));
-	if (hp == NULL)
-		fatal("Out of memory");
+	if (debug) {
+		(void) printf("quarantine(%s, %s)\n", name, what);
+	}
 
-	return(hp);
+	quarantine_list = (char **) realloc(quarantine_list,
+				(nquarantine + 1) * sizeof(char *));
+	qp = (Qentry *) malloc(sizeof(Qentry));
+	if (quarantine_list == NULL || qp == NULL) {
+		fatal("Out of memory");
+	}
+	quarantine_list[nquarantine++] = name;
+	b = qhash(name) % QBUCKETS;
+	qp->q_name = name;
+	qp->q_next = qtable[b];
+	qtable[b] = qp;
+	stats.s_quarantined++;
 }
 
 /*
- * compare the given files. returns 0 for identical files, and 1 if they are
- * different. if files are not readable, they are considered to be different,
- * and -1 is returned.
+ * at the end of the run, list the files that stalled.
  */
-static int
-compare(file1, file2)
-char *file1, *file2;
+static void
+stalled()
 {
-	register int fd1, fd2;		/* file descriptors */
-	register int n1, n2;		/* count of bytes read */
-	register int retval;		/* return value */
-	char buf1[BUFSIZ];		/* buffers for comparison */
-	char buf2[BUFSIZ];
+	register size_t i;
 
-	fd1 = open(file1, O_RDONLY);
-	if (fd1 == -1) {
-		return(-1);
+	if (nquarantine == 0) {
+		return;
 	}
 
-	fd2 = open(file2, O_RDONLY);
-	if (fd2 == -1) {
-		(void) close(fd1);
-		return(-1);
+	error(0, "%lu files stalled for more than %u seconds and were left alone:",
+				(unsigned long) nquarantine, timeout);
+	for (i = 0; i < nquarantine; i++) {
+		logmsg(2, "\t%s\n", quarantine_list[i]);
 	}
+}
 
-	/*
-	 * compare the contents of the two files.
-	 */
-	retval = 0;		/* files initially considered identical */
-	do {
-		n1 = read(fd1, buf1, sizeof(buf1));
-		n2 = read(fd2, buf2, sizeof(buf2));
-		if (n1 != n2) {
-			/*
-			 * files are different sizes.
-			 */
-			retval = 1;
-			break;
-		} else {
-			if (memcmp(buf1, buf2, n1) != 0) {
-				retval = 1;
-				break;
-			}
-		}
-	} while (n1 > 0 && n2 > 0);
+/*
+ * get a read buffer of IOBUFSIZE bytes from this thread's pool,
+ * allocating it the first time.  buffers must be given back with
+ * putbuf() in the reverse order to that they were got.
+ */
+static char *
+getbuf()
+{
+	register Bufpool *pp = &bufpool;
+	void *p;
 
-	/*
-	 * don't forget to close them files ...
-	 */
-	(void) close(fd1);
-	(void) close(fd2);
+	if (pp->p_used == NIOBUFS) {
+		fatal("read buffer pool exhausted");
+	}
 
-	return(retval);
+	if (pp->p_bufs[pp->p_used] == NULL) {
+		if (posix_memalign(&p, hugepages ? HUGEALIGN : IOBUFALIGN,
+							IOBUFSIZE) != 0) {
+			fatal("Out of memory");
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugepages) {
+			(void) madvise(p, IOBUFSIZE, MADV_HUGEPAGE);
+		}
+#endif
+		pp->p_bufs[pp->p_used] = p;
+	}
+
+	return(pp->p_bufs[pp->p_used++]);
 }
 
 /*
- * raise process priority for critical code.
- * note that if we are already running at a high priority,
- * this may slow us down slightly between critical sections.
+ * give back the buffer most recently got from getbuf().
  */
 static void
-raisepriority()
+putbuf(buf)
+char *buf;
 {
-	if (our_uid == -1) {
-		our_uid = geteuid();
-	}
-	if (our_uid == 0) {
-		(void) nice(PRIORITY);
-		niceness += PRIORITY;
+	register Bufpool *pp = &bufpool;
+
+	if (pp->p_used == 0 || (pp->p_bufs[pp->p_used - 1] != buf
+				 && pp->p_bufs[pp->p_used - 1] != NULL)) {
+		fatal("read buffer returned out of order");
 	}
+	pp->p_used--;
 }
 
 /*
- * put the priority back where it was.
+ * store a 64-bit number at p, most significant byte first.
  */
 static void
-lowerpriority()
+put64(p, val)
+unsigned char *p;
+uint64_t val;
 {
-	if (our_uid == 0) {
-		(void) nice(-niceness);
-		niceness = 0;
+	register int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = (unsigned char) val;
+		val >>= 8;
+	}
+}
+
+/*
+ * fetch a 64-bit number stored by put64.
+ */
+static uint64_t
+get64(p)
+unsigned char *p;
+{
+	uint64_t val = 0;
+	register int i;
+
+	for (i = 0; i < 8; i++) {
+		val = (val << 8) | p[i];
 	}
+	return(val);
 }
 
 /*
@@ -979,23 +6863,367 @@ static void
 verror(int syserr, char *string, va_list ap)
 {
 	char	errstr[64];
+	char	msg[1024];
 
 	/*
-	 * Get the error string first, in case it gets changed by fprintf().
+	 * Get the error string first, in case it gets changed by vsnprintf().
 	 */
 	(void) strncpy(errstr, strerror(errno), sizeof(errstr));
+	errstr[sizeof(errstr) - 1] = '\0';
 
-	(void) fprintf(stderr, "%s: ", progname);
-	(void) vfprintf(stderr, string, ap);
+	(void) vsnprintf(msg, sizeof(msg), string, ap);
+	logmsg(2, "%s: %s%s%s%s\n", progname, msg, syserr ? " [" : "",
+					syserr ? errstr : "", syserr ? "]" : "");
+}
+
+/*
+ * print an error message about the named file, as error(1, ...) does,
+ * unless LOGREPEAT errors like it (the same errno, in the same
+ * directory) have been printed already; in that case it is only
+ * counted, for logsummary().
+ */
+static void
+patherror(char *name, char *string, ...)
+{
+	va_list	ap;
+	int	err = errno;
+	char	*slash;
+	size_t	dirlen;
+	uint64_t h;
+	register size_t i;
+	register Logkey *kp;
+	unsigned long count;
+
+	slash = strrchr(name, '/');
+	dirlen = slash == NULL ? 0 : slash - name;
+	h = err;
+	for (i = 0; i < dirlen; i++) {
+		h = h * 0x100000001b3ULL ^ (unsigned char) name[i];
+	}
+
+	(void) pthread_mutex_lock(&keylock);
+	for (kp = logkeys[h % LOGKEYS]; kp != NULL; kp = kp->k_next) {
+		if (kp->k_errno == err && strlen(kp->k_dir) == dirlen
+		  && strncmp(kp->k_dir, name, dirlen) == 0) {
+			break;
+		}
+	}
+	if (kp == NULL) {
+		kp = (Logkey *) malloc(sizeof(Logkey));
+		if (kp == NULL || (kp->k_dir = strndup(name, dirlen)) == NULL) {
+			(void) pthread_mutex_unlock(&keylock);
+			fatal("Out of memory");
+		}
+		kp->k_errno = err;
+		kp->k_count = 0;
+		kp->k_next = logkeys[h % LOGKEYS];
+		logkeys[h % LOGKEYS] = kp;
+	}
+	count = ++kp->k_count;
+	(void) pthread_mutex_unlock(&keylock);
+
+	if (count <= LOGREPEAT) {
+		errno = err;
+		va_start(ap, string);
+		verror(1, string, ap);
+		va_end(ap);
+	}
+}
+
+/*
+ * at the end of the run, say how many errors of each kind patherror()
+ * didn't print.
+ */
+static void
+logsummary()
+{
+	register Logkey *kp;
+	register int b;
+
+	for (b = 0; b < LOGKEYS; b++) {
+		for (kp = logkeys[b]; kp != NULL; kp = kp->k_next) {
+			if (kp->k_count > LOGREPEAT) {
+				logmsg(2, "%s: %lu more like that in %s [%s]\n",
+					progname, kp->k_count - LOGREPEAT,
+					kp->k_dir[0] == '\0' ? "." : kp->k_dir,
+					strerror(kp->k_errno));
+			}
+		}
+	}
+}
+
+/*
+ * start the thread that writes the log.  it takes no signals, so
+ * that they all go to the main thread.  if it can't be started,
+ * messages are written as they come.
+ */
+static void
+loginit()
+{
+	pthread_t tid;
+	sigset_t all, old;
+
+	(void) sigfillset(&all);
+	(void) pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&tid, NULL, logwriter, NULL) == 0) {
+		(void) pthread_detach(tid);
+		logthread = 1;
+	}
+	(void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * add a message to this thread's buffer for fd, which is 1 or 2.
+ */
+static void
+logmsg(int fd, char *string, ...)
+{
+	va_list	ap;
+
+	va_start(ap, string);
+	vlogmsg(fd, string, ap);
+	va_end(ap);
+}
+
+static void
+vlogmsg(int fd, char *string, va_list ap)
+{
+	Logstate *sp = mylogstate();
+	Logbuf	**bpp;
+	register Logbuf *bp;
+	va_list	aq;
+	int	n, tries;
+	struct timespec ts;
+
+	if (sp == NULL) {
+		logflush();
+		(void) vdprintf(fd, string, ap);
+		return;
+	}
+	bpp = &sp->s_bufs[fd == 2];
+
+	(void) clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	(void) pthread_mutex_lock(&sp->s_lock);
+	for (tries = 0; tries < 2; tries++) {
+		if (*bpp == NULL) {
+			(void) pthread_mutex_lock(&loglock);
+			bp = logfree;
+			if (bp != NULL) {
+				logfree = bp->g_next;
+			}
+			(void) pthread_mutex_unlock(&loglock);
+			if (bp == NULL && (bp = malloc(sizeof(Logbuf))) == NULL) {
+				break;
+			}
+			bp->g_fd = fd;
+			bp->g_len = 0;
+			bp->g_started = ts.tv_sec;
+			*bpp = bp;
+		}
+		bp = *bpp;
+
+		va_copy(aq, ap);
+		n = vsnprintf(bp->g_data + bp->g_len, LOGBUFSIZE - bp->g_len,
+								string, aq);
+		va_end(aq);
+		if (n < 0) {
+			(void) pthread_mutex_unlock(&sp->s_lock);
+			return;
+		}
+		if (bp->g_len + n < LOGBUFSIZE) {
+			bp->g_len += n;
+			if (ts.tv_sec - bp->g_started >= LOGDELAY) {
+				*bpp = NULL;
+				loghand(bp);
+			}
+			(void) pthread_mutex_unlock(&sp->s_lock);
+			return;
+		}
+
+		/*
+		 * It doesn't fit: send off what there is and try again
+		 * with an empty buffer.
+		 */
+		*bpp = NULL;
+		if (bp->g_len > 0) {
+			loghand(bp);
+		} else {
+			(void) pthread_mutex_lock(&loglock);
+			bp->g_next = logfree;
+			logfree = bp;
+			(void) pthread_mutex_unlock(&loglock);
+		}
+	}
+
+	(void) pthread_mutex_unlock(&sp->s_lock);
+
+	/*
+	 * Too long for a buffer, or no memory for one: write it now,
+	 * after everything before it.
+	 */
+	logflush();
+	(void) vdprintf(fd, string, ap);
+}
 
-	if (syserr) {
-		(void) fprintf(stderr, " [%s]", errstr);
+/*
+ * the calling thread's log buffers, set up on its first message; NULL
+ * if there is no memory for them.
+ */
+static Logstate *
+mylogstate()
+{
+	register Logstate *sp = logstate;
+
+	if (sp != NULL) {
+		return(sp);
+	}
+	sp = (Logstate *) calloc(1, sizeof(Logstate));
+	if (sp == NULL) {
+		return(NULL);
+	}
+	(void) pthread_mutex_init(&sp->s_lock, NULL);
+	(void) pthread_mutex_lock(&statelock);
+	sp->s_next = logstates;
+	logstates = sp;
+	(void) pthread_mutex_unlock(&statelock);
+	logstate = sp;
+	return(sp);
+}
+
+/*
+ * give a buffer to the writer, or write it ourselves if there isn't one.
+ */
+static void
+loghand(bp)
+Logbuf *bp;
+{
+	if (!logthread) {
+		writeall(bp->g_fd, bp->g_data, bp->g_len);
+		free(bp);
+		return;
+	}
+
+	bp->g_next = NULL;
+	(void) pthread_mutex_lock(&loglock);
+	*logtail = bp;
+	logtail = &bp->g_next;
+	(void) pthread_cond_signal(&logwork);
+	(void) pthread_mutex_unlock(&loglock);
+}
+
+/*
+ * hand over every thread's buffers, and wait until everything has been
+ * written.
+ */
+static void
+logflush()
+{
+	(void) fflush(stdout);
+	logsweep();
+
+	(void) pthread_mutex_lock(&loglock);
+	while (logqueue != NULL || logbusy) {
+		(void) pthread_cond_wait(&logidle, &loglock);
+	}
+	(void) pthread_mutex_unlock(&loglock);
+}
+
+/*
+ * hand over whatever every thread has in its buffers.
+ */
+static void
+logsweep()
+{
+	register Logstate *sp;
+	register int i;
+
+	(void) pthread_mutex_lock(&statelock);
+	for (sp = logstates; sp != NULL; sp = sp->s_next) {
+		(void) pthread_mutex_lock(&sp->s_lock);
+		for (i = 0; i < 2; i++) {
+			if (sp->s_bufs[i] != NULL && sp->s_bufs[i]->g_len > 0) {
+				loghand(sp->s_bufs[i]);
+				sp->s_bufs[i] = NULL;
+			}
+		}
+		(void) pthread_mutex_unlock(&sp->s_lock);
+	}
+	(void) pthread_mutex_unlock(&statelock);
+}
+
+/*
+ * the writer thread: write out buffers as they are queued, and every
+ * LOGDELAY seconds sweep up those that threads are still holding.
+ */
+static void *
+logwriter(void *arg)
+{
+	register Logbuf *bp;
+	struct timespec next, ts;
+
+	(void) arg;
+
+	(void) clock_gettime(CLOCK_REALTIME, &next);
+	next.tv_sec += LOGDELAY;
+	(void) pthread_mutex_lock(&loglock);
+	for (;;) {
+		(void) clock_gettime(CLOCK_REALTIME, &ts);
+		if (ts.tv_sec > next.tv_sec || (ts.tv_sec == next.tv_sec
+					&& ts.tv_nsec >= next.tv_nsec)) {
+			(void) pthread_mutex_unlock(&loglock);
+			logsweep();
+			(void) pthread_mutex_lock(&loglock);
+			next = ts;
+			next.tv_sec += LOGDELAY;
+		}
+		if (logqueue == NULL) {
+			logbusy = 0;
+			(void) pthread_cond_broadcast(&logidle);
+			(void) pthread_cond_timedwait(&logwork, &loglock, &next);
+			continue;
+		}
+		bp = logqueue;
+		logqueue = bp->g_next;
+		if (logqueue == NULL) {
+			logtail = &logqueue;
+		}
+		logbusy = 1;
+		(void) pthread_mutex_unlock(&loglock);
+
+		writeall(bp->g_fd, bp->g_data, bp->g_len);
+
+		(void) pthread_mutex_lock(&loglock);
+		bp->g_next = logfree;
+		logfree = bp;
+	}
+	/*NOTREACHED*/
+	return(NULL);
+}
+
+/*
+ * write all of buf to fd, as far as we can.
+ */
+static void
+writeall(int fd, char *buf, size_t len)
+{
+	register ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
 	}
-	(void) putc('\n', stderr);
 }
 
 /*
- * print an error message and die.
+ * print an error message and die.  everything logged before it, and
+ * it, is written before we go.
  */
 static void
 fatal(char *string, ...)
@@ -1006,5 +7234,23 @@ fatal(char *string, ...)
 	verror(1, string, ap);
 	va_end(ap);
 
+	logflush();
 	exit(1);
 }
+
+/*
+ * print an error message, as error() does, that mustn't be lost if we
+ * are killed soon after: it, and everything logged before it, has been
+ * written when we return.
+ */
+static void
+urgent(int syserr, char *string, ...)
+{
+	va_list	ap;
+
+	va_start(ap, string);
+	verror(syserr, string, ap);
+	va_end(ap);
+
+	logflush();
+}
@@ -0,0 +1,19 @@
+/*
+ * SHA-256 message digest (FIPS 180-4), for identifying file contents.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define	SHA256_LEN	32		/* bytes in a digest */
+
+typedef struct sha256 {
+	uint32_t	s_h[8];		/* intermediate hash value */
+	uint64_t	s_len;		/* bytes hashed so far */
+	unsigned char	s_buf[64];	/* partial block */
+	size_t		s_fill;		/* bytes in s_buf */
+} Sha256;
+
+extern	void	sha256init(Sha256 *);
+extern	void	sha256update(Sha256 *, const void *, size_t);
+extern	void	sha256final(Sha256 *, unsigned char *);